@@ -0,0 +1,257 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_RDP_IPCWORKER_H
+#define QEMU_RDP_IPCWORKER_H
+
+#include <atomic>
+#include <thread>
+#include <msgpack/sbuffer.hpp>
+#include "common.h"
+#include "util/ListenerTable.h"
+#include "util/MessageQueue.h"
+#include "util/zmq_addon.hpp"
+#include "rdp/RDPListener.h"
+
+/**
+ * @brief The IPCWorker class owns one ZeroMQ ROUTER socket and the thread that services it.
+ *
+ * The RDPServerWorker partitions VMs across a pool of IPCWorkers by the slot of their handle in its ListenerTable.
+ * Each IPCWorker receives and deserializes messages from the VMs in its partition, dispatches them to the appropriate
+ * RDP listener, and sends outgoing messages back to those VMs, independently of the other workers in the pool.
+ */
+class IPCWorker
+{
+public:
+    /**
+     * @brief Creates a new IPCWorker and binds its ROUTER socket.
+     *
+     * @param context The ZeroMQ context shared by all workers in the pool.
+     * @param path The ZeroMQ endpoint to bind to.
+     * @param table The table VM handles are resolved in.
+     */
+    IPCWorker(zmq::context_t &context, std::string path, ListenerTable &table);
+
+    /**
+     * @brief Sets stop to true, wakes the worker thread and joins it.
+     */
+    ~IPCWorker();
+
+    /**
+     * @brief Starts the worker thread.
+     */
+    void Start();
+
+    /**
+     * @brief Gets the ZeroMQ endpoint VMs in this partition should connect to.
+     */
+    std::string SocketPath();
+
+    /**
+     * @brief Adds a listener to this worker's partition.
+     *
+     * The UUID is only needed to resolve messages from VMs that address the daemon by UUID rather than by handle.
+     *
+     * @param uuid UUID of the VM the listener serves.
+     * @param handle Handle of the listener in the ListenerTable.
+     */
+    void AddListener(std::string uuid, uint32_t handle);
+
+    /**
+     * @brief Removes a listener from this worker's partition.
+     *
+     * @param uuid UUID of the VM the listener serves.
+     */
+    void RemoveListener(std::string uuid);
+
+    /**
+     * @brief Queues outgoing message and wakes the worker thread to send it.
+     *
+     * Safe to call from any thread, and never blocks. If the worker thread is busy it will pick the message up
+     * before it next sleeps, so the eventfd is only written when the worker is actually waiting on it.
+     *
+     * @param item QueueItem to be sent.
+     */
+    void queueOutgoingMessage(const QueueItem &item);
+
+protected:
+    /**
+     * @brief ZeroMQ endpoint the socket is bound to.
+     */
+    std::string path;
+
+    /**
+     * @brief Variable set to indicate when the worker is stopping.
+     */
+    std::atomic<bool> stop;
+
+    /**
+     * @brief eventfd polled alongside the ZeroMQ socket, written to whenever out_queue has work or stop is set.
+     */
+    int wake_fd;
+
+    /**
+     * @brief Set by the worker thread right before it blocks in poll, and cleared by whoever wakes it up.
+     */
+    std::atomic<bool> waiting;
+
+    /**
+     * @brief Value of out_queue.Dropped() when it was last logged.
+     */
+    uint64_t reported_drops;
+
+    /**
+     * @brief Thread running the main loop.
+     */
+    std::thread loop_thread;
+
+    /**
+     * @brief Hashmap from UUID to the handles of the VMs in this partition.
+     */
+    std::map<std::string, uint32_t> uuid_handles;
+
+    /**
+     * @brief mutex on uuid_handles so that listeners can be added and removed from other threads.
+     */
+    std::mutex listener_lock;
+
+    /**
+     * @brief This worker's view of the listener table. Only touched by the worker thread.
+     */
+    ListenerTableReader listeners;
+
+    /**
+     * @brief How to reach a VM over the socket.
+     */
+    struct Route {
+        /**
+         * @brief Handle of the VM the route belongs to, or 0 if the slot has never been used.
+         */
+        uint32_t handle = 0;
+
+        /**
+         * @brief Whether the VM addresses us by handle rather than by UUID, and so expects the same back.
+         */
+        bool by_handle = false;
+
+        /**
+         * @brief ZeroMQ connection id of the VM.
+         */
+        std::string id;
+    };
+
+    /**
+     * @brief Routes indexed by handle slot. Only touched by the worker thread.
+     */
+    std::vector<Route> routes;
+
+    /**
+     * @brief Queue containing outbound messages. Written by the FreeRDP peer threads, read by the worker thread.
+     */
+    MessageQueue out_queue;
+
+    /**
+     * @brief ZeroMQ socket.
+     */
+    zmq::socket_t zsocket;
+
+    /**
+     * @brief Frames of the message currently being received, kept around so their storage is reused.
+     */
+    zmq::message_t id_frame, addr_frame, data_frame;
+
+    /**
+     * @brief UUID of the message currently being received, kept around so its storage is reused.
+     */
+    std::string uuid_buf;
+
+    /**
+     * @brief Cursor shape currently being received, kept around so its pixel buffer is reused.
+     */
+    CursorShape cursor_buf;
+
+    /**
+     * @brief A motion-only mouse event waiting to be sent, and how many earlier motion events it replaced.
+     */
+    struct PendingMotion {
+        QueueItem item;
+        uint64_t coalesced;
+    };
+
+    /**
+     * @brief Latest pending motion event of every VM that had one in the current batch. Only touched by the worker
+     * thread.
+     */
+    std::vector<PendingMotion> pending_motion;
+
+    /**
+     * @brief Buffer protocol version 5 messages are packed into, kept around so its storage is reused.
+     */
+    msgpack::sbuffer pack_buf;
+
+    /**
+     * @brief Receives one message from the socket, decodes it and dispatches it to the right listener.
+     *
+     * Fields are decoded straight out of the ZeroMQ frames into a VMMessage on the stack, so in the steady state
+     * receiving a message performs no allocations.
+     */
+    void receiveMessage();
+
+    /**
+     * @brief Send a message to the VM with the handle in the record.
+     *
+     * @param item The message to be serialized and sent.
+     * @param coalesced Number of motion events item stands in for, on top of itself. Only used for counting.
+     */
+    void sendMessage(const QueueItem &item, uint64_t coalesced = 0);
+
+    /**
+     * @brief Sends a message, logging and dropping it if ZeroMQ throws.
+     */
+    void dispatchMessage(const QueueItem &item, uint64_t coalesced = 0);
+
+    /**
+     * @brief Holds a motion-only mouse event back, replacing the VM's previously held back one.
+     *
+     * Only the latest cursor position matters to the VM, so consecutive motion events in a batch are merged into
+     * one. Anything else for the VM flushes the held back motion first, so button and wheel events are never
+     * reordered with respect to motion.
+     *
+     * @param item The motion event.
+     */
+    void coalesceMotion(const QueueItem &item);
+
+    /**
+     * @brief Sends the held back motion event of a VM, if it has one.
+     *
+     * @param handle Handle of the VM, or 0 to flush every VM's motion event.
+     */
+    void flushMotion(uint32_t handle);
+
+    /**
+     * @brief Main loop function that receives messages and processes them for dispatch to the RDP listener.
+     *
+     * The loop blocks until either a message arrives on the ZeroMQ socket or wake_fd is signalled.
+     */
+    void run();
+
+    /**
+     * @brief Wakes the main loop out of its poll.
+     */
+    void wake();
+};
+
+#endif //QEMU_RDP_IPCWORKER_H
@@ -19,17 +19,22 @@
 
 #include <giomm/dbusconnection.h>
 #include "common.h"
+#include "IPCWorker.h"
+#include "util/ListenerTable.h"
 #include "util/MessageQueue.h"
+#include "util/PortPool.h"
+#include "util/ThreadPool.h"
 #include "util/zmq_addon.hpp"
 #include "rdp/RDPListener.h"
 
 /**
- * @brief The RDPServerWorker class manages the lifetime of the ZeroMQ socket. It also manages the lifetimes of all
- * associated VM connections and RDP listeners.
+ * @brief The RDPServerWorker class manages the lifetime of the pool of IPCWorkers. It also manages the lifetimes of
+ * all associated VM connections and RDP listeners.
  *
- * The RDPServerWorker is created and initialized during RDPMux startup. It manages the lifecycle of the ZeroMQ
- * socket. In addition, the RDPServerworker manages the deserialization of messages from the VM, and dispatching
- * messages to and from the appropriate RDP listener.
+ * The RDPServerWorker is created and initialized during RDPMux startup. It owns the ZeroMQ context and a pool of
+ * IPCWorkers, each with its own socket and thread, and assigns every VM to one of them by the slot of its handle in
+ * the ListenerTable, modulo the size of the pool. The IPCWorkers manage the deserialization of messages from the VM,
+ * and dispatching messages to and from the appropriate RDP listener.
  */
 class RDPServerWorker
 {
@@ -37,13 +42,17 @@ public:
     /**
      * @brief Creates a new RDPServerWorker.
      *
-     * Upon creation, a new ZeroMQ ROUTER socket is created and/or bound to. No events are processed until
+     * Upon creation, one ZeroMQ ROUTER socket per IPCWorker is created and bound to. No events are processed until
      * a VM has registered using RegisterNewVM();
      *
-     * @param port The starting port for new RDP listener connections
+     * @param first_port The first port of the range new RDP listeners are started on.
+     * @param last_port The last port of the range new RDP listeners are started on.
      * @param auth Whether to start listeners with NLA authentication enabled.
+     * @param num_workers Number of IPCWorker threads to spread VMs across.
+     * @param copy_threads Number of threads helping the listeners copy large frames.
      */
-    RDPServerWorker(uint16_t port, bool auth);
+    RDPServerWorker(uint16_t first_port, uint16_t last_port, bool auth, unsigned int num_workers,
+                    unsigned int copy_threads);
 
     /**
      * @brief Initializes the run loop. After this function returns successfully, the ServerWorker is ready to process
@@ -54,8 +63,7 @@ public:
     /**
      * @brief Safely takes down the server worker.
      *
-     * Sets stop to true to indicate to the worker thread to stop processing, then joins the thread and waits for
-     * completion.
+     * Stops and joins every IPCWorker before the listeners and the ZeroMQ context are torn down.
      */
     ~RDPServerWorker();
 
@@ -68,57 +76,51 @@ public:
      * @param vm_id Unique ID of VM fb.
      * @param auth Path to auth file for RDP session. Empty if no file.
      * @param port Preferred port for RDP server to be listening on.
+     * @param version Protocol version the VM speaks.
+     * @param shm_fd Memory file holding the VM's framebuffer, or -1 if the VM shares it by name. Owned by the
+     * RDPServerWorker from here on, whether or not registration succeeds.
      *
-     * @returns bool Success
+     * @returns The handle the VM can address itself with on its socket, or 0 on failure.
      */
-    bool RegisterNewVM(std::string uuid, int vm_id, std::string auth, uint16_t port);
+    uint32_t RegisterNewVM(std::string uuid, int vm_id, std::string auth, uint16_t port, int version, int shm_fd);
 
     /**
      * @brief Unregisters VM.
      *
-     * Removes listener port from open ports list and removes the shared_ptr wrapping the RDPListener object.
-     * Everything will self-destruct as that shared_ptr goes out of scope, so be careful when you invoke this!
+     * Returns the listener's port to the pool and removes the shared_ptr wrapping the RDPListener object.
+     * Everything will self-destruct as that shared_ptr goes out of scope, so be careful when you invoke this! Unknown
+     * UUIDs are ignored.
      */
-    void UnregisterVM(std::string uuid, uint16_t port);
+    void UnregisterVM(std::string uuid);
 
     /**
-     * @brief Sets the current DBus connection for internal usage.
+     * @brief Gets the ZeroMQ endpoint that the VM with the given handle should connect to.
      *
-     * @param conn Reference to the DBus connection object.
+     * @param handle Handle returned by RegisterNewVM().
      */
-    void setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn);
+    std::string SocketPath(uint32_t handle);
 
     /**
-     * @brief Send a message to the VM with the identity espoused by the UUID.
+     * @brief Sets the current DBus connection for internal usage.
      *
-     * @param vec Vector containing the data to be serialized.
-     * @param uuid The UUID of the VM to send this message to.
+     * @param conn Reference to the DBus connection object.
      */
-    void sendMessage(std::vector<uint16_t> vec, std::string uuid);
+    void setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn);
 
     /**
-     * @brief Queues outgoing message.
+     * @brief Queues outgoing message on the IPCWorker that owns the destination VM.
      *
      * @param item QueueItem to be sent.
      */
-    void queueOutgoingMessage(QueueItem item);
-
-protected:
-    /**
-     * @brief Starting port for new connections.
-     */
-    uint16_t starting_port;
+    void queueOutgoingMessage(const QueueItem &item);
 
     /**
-     * @brief Lock guarding stop.
+     * @brief Gets the pool of threads the listeners copy large frames with. Every listener holds on to it, so it
+     * outlives both the RDPServerWorker and the capture threads still copying with it.
      */
-    std::mutex stop_mutex;
-
-    /**
-     * @brief Variable set to indicate when the RDPServerWorker is stopping.
-     */
-    bool stop;
+    std::shared_ptr<ThreadPool> CopyPool();
 
+protected:
     /**
      * @brief Whether the ServerWorker is initialized.
      */
@@ -130,17 +132,12 @@ protected:
     std::map<std::string, std::shared_ptr<RDPListener>> listener_map;
 
     /**
-     * @brief Hashmap from UUID to current ZeroMQ connection id
-     */
-    std::map<std::string, std::string> connection_map;
-
-    /**
-     * @brief Set containing all in-use ports. Used to intelligently re-use ports as VMs come and go.
+     * @brief Pool of listener ports. Has its own lock, so ports can be handed out without container_lock.
      */
-    std::set<uint16_t> ports;
+    PortPool port_pool;
 
     /**
-     * @brief mutex on ports so that concurrent accesses are okay.
+     * @brief mutex on listener_map so that concurrent accesses are okay.
      */
     std::mutex container_lock;
 
@@ -150,19 +147,19 @@ protected:
     Glib::RefPtr<Gio::DBus::Connection> dbus_conn;
 
     /**
-     * @brief Queue containing outbound messages.
+     * @brief Table resolving VM handles to listeners for the IPCWorkers, without going through container_lock.
      */
-    MessageQueue out_queue;
+    ListenerTable listeners;
 
     /**
-     * @brief ZeroMQ context.
+     * @brief ZeroMQ context shared by all IPCWorkers.
      */
     zmq::context_t context;
 
     /**
-     * @brief ZeroMQ socket.
+     * @brief Pool of IPCWorkers. VMs are assigned to a worker by handle slot.
      */
-    zmq::socket_t zsocket;
+    std::vector<std::unique_ptr<IPCWorker>> workers;
 
     /**
      * @brief whether RDPMux should authenticate peer connections.
@@ -170,9 +167,14 @@ protected:
     bool authenticating;
 
     /**
-     * @brief Main loop function that receives messages and processes them for dispatch to the RDP listener.
+     * @brief Threads shared by every listener for copying large frames in bands.
+     */
+    std::shared_ptr<ThreadPool> copy_pool;
+
+    /**
+     * @brief Gets the IPCWorker responsible for the VM with the given handle.
      */
-    void run();
+    IPCWorker *workerFor(uint32_t handle);
 };
 
 
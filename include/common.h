@@ -18,11 +18,106 @@
 #define QEMU_RDP_COMMON_H
 
 #include <memory>
+#include <vector>
 #include <cstdbool>
 #include "util/logging.h"
 #include <giomm-2.4/giomm.h>
 
-#define RDPMUX_PROTOCOL_VERSION 5
+/**
+ * @brief Newest protocol version, which sends fixed-layout little-endian messages.
+ */
+#define RDPMUX_PROTOCOL_VERSION 6
+
+/**
+ * @brief Oldest protocol version still accepted, which sends msgpack arrays.
+ */
+#define RDPMUX_PROTOCOL_VERSION_MSGPACK 5
+
+/**
+ * @brief Size of the {type, length} header that starts every version 6 message.
+ */
+#define RDPMUX_WIRE_HEADER_SIZE (2 * sizeof(uint32_t))
+
+/**
+ * @brief Maximum number of dirty rectangles accepted in a single DISPLAY_UPDATE message.
+ */
+#define RDPMUX_MAX_DAMAGE_RECTS 16
+
+/**
+ * @brief Maximum number of values in a message from the VM: the type, plus x, y, w and h for every dirty rectangle.
+ */
+#define RDPMUX_MAX_MESSAGE_LENGTH (1 + 4 * RDPMUX_MAX_DAMAGE_RECTS)
+
+/**
+ * @brief Length of a VM UUID in its canonical textual form.
+ */
+#define RDPMUX_UUID_LENGTH 36
+
+/**
+ * @brief Magic number at the start of a version 6 shared memory region, "RMUX" in little-endian.
+ */
+#define RDPMUX_SHM_MAGIC 0x584d5552
+
+/**
+ * @brief Number of frame slots in a version 6 shared memory region.
+ */
+#define RDPMUX_SHM_SLOTS 2
+
+/**
+ * @brief Offset of the first frame slot in a version 6 shared memory region.
+ */
+#define RDPMUX_SHM_HEADER_SIZE 4096
+
+/**
+ * @brief Values of ShmHeader::page_mode: how the VM backed its shared memory region.
+ */
+#define RDPMUX_SHM_PAGES_NORMAL 0
+#define RDPMUX_SHM_PAGES_TRANSPARENT 1
+#define RDPMUX_SHM_PAGES_HUGETLB 2
+
+/**
+ * @brief Default for the highest frame rate the VM is asked to draw at, which it gets while someone is watching and
+ * the clients keep up.
+ */
+#define RDPMUX_MAX_FRAMERATE 30
+
+/**
+ * @brief Default for the lowest frame rate the VM is asked to draw at, which it gets while nobody is connected.
+ */
+#define RDPMUX_IDLE_FRAMERATE 1
+
+/**
+ * @brief Highest frame rate that can be configured. The capture loop waits 1000 / fps ms between frames, and that has
+ * to come out to at least 1.
+ */
+#define RDPMUX_FRAMERATE_LIMIT 1000u
+
+/**
+ * @brief How long the capture thread of a VM that sends no damage sleeps between frames, in ms.
+ */
+#define RDPMUX_IDLE_WAKEUP_MS 1000
+
+/**
+ * @brief Number of damaged pixels from which a frame is copied in bands across the copy threads, rather than by the
+ * capture thread alone. Below it, waking the threads costs more than they save.
+ */
+#define RDPMUX_PARALLEL_COPY_MIN_PIXELS (512 * 512)
+
+/**
+ * @brief How many times a torn frame is read again before its damage is deferred to the next frame.
+ */
+#define RDPMUX_FRAME_READ_ATTEMPTS 3
+
+/**
+ * @brief Largest cursor width and height in px accepted from a VM. RDP clients only have to support cursors up to
+ * this size.
+ */
+#define RDPMUX_MAX_CURSOR_SIZE 96
+
+/**
+ * @brief Size of a CPU cache line, used to pad apart fields written by different threads.
+ */
+#define RDPMUX_CACHELINE_SIZE 64
 
 /**
  * @brief enum of message types.
@@ -34,7 +129,63 @@ enum message_type {
     MOUSE,
     KEYBOARD,
     DISPLAY_UPDATE_COMPLETE,
-    SHUTDOWN
+    SHUTDOWN,
+    CURSOR_DEFINE,
+    CURSOR_MOVE
+};
+
+/**
+ * @brief Fixed-size decoded form of a message from the VM.
+ *
+ * Messages are decoded straight from the ZeroMQ frame into this struct, so receiving a message never allocates.
+ * data[0] holds the message type, and the rest of the values are specific to the message type.
+ */
+struct VMMessage {
+    /**
+     * @brief Number of valid entries in data.
+     */
+    size_t length;
+
+    /**
+     * @brief The message values.
+     */
+    uint32_t data[RDPMUX_MAX_MESSAGE_LENGTH];
+};
+
+/**
+ * @brief A cursor shape sent by the VM in a CURSOR_DEFINE message.
+ *
+ * Cursor shapes carry their pixels, so they don't fit in a VMMessage and are decoded into one of these instead.
+ */
+struct CursorShape {
+    uint32_t hot_x;
+    uint32_t hot_y;
+    uint32_t width;
+    uint32_t height;
+
+    /**
+     * @brief The pixels, row by row without padding, 4 bytes each in B, G, R, A order with straight alpha. That's
+     * a8r8g8b8 stored little-endian, just as they come off the wire.
+     */
+    std::vector<uint8_t> pixels;
+};
+
+/**
+ * @brief Header at the start of a version 6 shared memory region. Mirrors mux_shm_header in librdpmux.
+ *
+ * The region holds RDPMUX_SHM_SLOTS complete copies of the framebuffer. The VM only ever writes to a slot that isn't
+ * front, and flips front once the slot is complete. Each slot has a sequence number that is odd while the slot is
+ * being written, so a reader that took too long and had the slot rewritten under it can tell and retry.
+ */
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint64_t header_size;
+    uint64_t slot_size;
+    uint64_t frame_seq;
+    uint32_t front;
+    uint32_t page_mode;
+    uint64_t slot_seq[RDPMUX_SHM_SLOTS];
 };
 
 /**
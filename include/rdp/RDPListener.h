@@ -18,6 +18,7 @@
 #define QEMU_RDP_RDPLISTENER_H
 
 #include "common.h"
+#include <atomic>
 #include <freerdp/freerdp.h>
 #include <freerdp/listener.h>
 #include <pixman.h>
@@ -25,8 +26,24 @@
 #include <winpr/winsock.h>
 #include <freerdp/server/shadow.h>
 
+/**
+ * @brief How a listener's capture loop trades latency against throughput.
+ */
+enum class FrameProfile {
+    /**
+     * @brief Take a frame as soon as damage arrives, as long as the frame rate allows it.
+     */
+    Latency,
+    /**
+     * @brief Wait a frame interval after damage arrives before taking the frame, so that a burst of damage is encoded
+     * and sent as one frame.
+     */
+    Throughput,
+};
+
 class RDPPeer; // I'm very bad at organizing C++ code.
 class RDPServerWorker; // I continue to get worse at organizing C++ code.
+class ThreadPool;
 
 extern BOOL start_peerloop(freerdp_listener *instance, freerdp_peer *client);
 
@@ -48,9 +65,11 @@ public:
      * @param parent A pointer to the RDPServerWorker for (LIMITED) use // todo: not so limited
      * @param auth Path to auth file. Empty if no auth.
      * @param conn Reference to the process's DBus connection for exposing the Listener object
+     * @param version The protocol version the VM registered with.
+     * @param shm_fd Memory file holding the framebuffer, or -1 to open it by name. The listener takes ownership.
      */
     RDPListener(std::string uuid, int vm_id, uint16_t port, RDPServerWorker *parent, std::string auth,
-                Glib::RefPtr<Gio::DBus::Connection> conn);
+                Glib::RefPtr<Gio::DBus::Connection> conn, int version, int shm_fd);
     /**
      * @brief Safely cleans up the freerdp_listener struct and frees all WinPR objects.
      */
@@ -64,31 +83,30 @@ public:
     /**
      * @brief Processes outgoing messages from the RDP client to the VM.
      *
-     * @param vec Array of outgoing values.
+     * @param values Outgoing values, message type first. At most RDPMUX_MAX_OUTGOING_LENGTH of them.
      */
-    void processOutgoingMessage(std::vector<uint16_t> vec);
+    void processOutgoingMessage(std::initializer_list<uint32_t> values);
 
     /**
      * @brief Processes incoming messages from the VM.
      *
      * Serves as an entry point for incoming messages from the VM via the RDPServerWorker.
      *
-     * @param rvec Deserialized vector of uint32_ts comprising the message
+     * @param msg The decoded message
      */
-    void processIncomingMessage(std::vector<uint32_t> rvec);
+    void processIncomingMessage(const VMMessage &msg);
 
     /**
      * @brief Processes display updates and sends them to peers.
      *
-     * The listener first retrieves the update parameters from the deserialized message passed in. It then sends a
-     * display update to all connected peers (which are sharing the same VM session and framebuffer) in a thread-safe
-     * manner. This prevents connection threads from updating the list of connected peers while an update is in-flight.
-     * It then sends back the DISPLAY_UPDATE_COMPLETE message to the VM.
+     * The listener retrieves the list of dirty rectangles from the deserialized message passed in and adds them to
+     * the accumulated dirty region, which is drained by the shadow subsystem on its next capture tick. Updates that
+     * arrive between two ticks are merged rather than overwriting each other.
      *
-     * @param msg The deserialized update message. Should be guaranteed by caller to be from a message of type
-     * DISPLAY_UPDATE.
+     * @param msg The decoded update message. Should be guaranteed by caller to be from a message of type
+     * DISPLAY_UPDATE. Holds x, y, w and h for up to RDPMUX_MAX_DAMAGE_RECTS rectangles after the message type.
      */
-    void processDisplayUpdate(std::vector<uint32_t> msg);
+    void processDisplayUpdate(const VMMessage &msg);
 
     /**
      * @brief Processes display switch events and sends them to peers.
@@ -98,10 +116,55 @@ public:
      * first time a display switch event is received, during initialization) and notifies all connected peers
      * to perform a full screen refresh using RDPPeer::FullDisplayUpdate.
      *
-     * @param msg The deserialized display switch message. Should be guaranteed by caller to be from a message of type
+     * @param msg The decoded display switch message. Should be guaranteed by caller to be from a message of type
      * DISPLAY_SWITCH.
      */
-    void processDisplaySwitch(std::vector<uint32_t> msg);
+    void processDisplaySwitch(const VMMessage &msg);
+
+    /**
+     * @brief Takes on a new cursor shape from the VM and wakes the shadow subsystem thread to show it to the peers.
+     *
+     * @param shape The decoded CURSOR_DEFINE message. Copied, so the caller can reuse it.
+     */
+    void processCursorDefine(const CursorShape &shape);
+
+    /**
+     * @brief Takes on a new cursor position from the VM and wakes the shadow subsystem thread to move the peers'
+     * cursors. Nothing about the framebuffer changes, so no frame is taken for it.
+     *
+     * @param msg The decoded message. Should be guaranteed by caller to be from a message of type CURSOR_MOVE.
+     */
+    void processCursorMove(const VMMessage &msg);
+
+    /**
+     * @brief Gets the VM's cursor shape.
+     *
+     * @param shape Filled in with the shape.
+     * @param changed_only Only fill in the shape if it changed since the last call with changed_only set.
+     *
+     * @returns Whether shape was filled in. False if the VM never defined a cursor.
+     */
+    bool GetCursorShape(CursorShape &shape, bool changed_only);
+
+    /**
+     * @brief Gets the position of the VM's cursor.
+     *
+     * @param x Filled in with the x-coordinate of the cursor's hotspot.
+     * @param y Filled in with the y-coordinate of the cursor's hotspot.
+     * @param changed_only Only fill in the position if it changed since the last call with changed_only set.
+     *
+     * @returns Whether x and y were filled in. False if the VM never moved its cursor.
+     */
+    bool GetCursorPosition(uint32_t &x, uint32_t &y, bool changed_only);
+
+    /**
+     * @brief Gets the event signaled when the VM's cursor changes shape or moves.
+     *
+     * The event is manual-reset. The shadow subsystem thread resets it before picking up the changes.
+     *
+     * @returns The event handle. Owned by the listener.
+     */
+    HANDLE CursorEvent();
 
     /**
      * @brief Gets the width of the framebuffer.
@@ -117,6 +180,27 @@ public:
      */
     size_t Height();
 
+    /**
+     * @brief Gets the event signaled when the VM sends damage or switches its framebuffer, or the listener stops.
+     *
+     * The event is manual-reset. The shadow subsystem thread resets it before taking a frame.
+     *
+     * @returns The event handle. Owned by the listener.
+     */
+    HANDLE DamageEvent();
+
+    /**
+     * @brief Gets the pool of threads shared by all listeners for copying large frames.
+     */
+    ThreadPool &CopyPool();
+
+    /**
+     * @brief Gets the pixman format of the framebuffer.
+     *
+     * @returns The pixman format of the framebuffer.
+     */
+    pixman_format_code_t Format();
+
     /**
      * @brief Gets the RDP pixel format of the framebuffer.
      *
@@ -125,11 +209,115 @@ public:
     std::tuple<int, int, int> GetRDPFormat();
 
     /**
-     * @brief Gets the dimensions of the dirty region in thread-safe manner.
+     * @brief Maps the VM's shared memory region, or maps it again if the VM has switched to a framebuffer that
+     * doesn't fit the current mapping.
+     *
+     * Only call this from the thread that reads the framebuffer, since a remap unmaps the old region.
+     *
+     * @returns Whether there is a mapping that holds the whole framebuffer.
+     */
+    bool MapFramebuffer();
+
+    /**
+     * @brief Starts reading the most recently published frame.
+     *
+     * Never blocks the VM. Once done reading, pass the slot and sequence number to EndFrameRead() to find out
+     * whether the frame stayed intact.
      *
-     * @returns The dimensions in this order: x, y, w, h.
+     * @param slot Filled in with the slot being read.
+     * @param seq Filled in with the sequence number of the slot when reading started.
+     *
+     * @returns Pointer to the frame's pixels, or nullptr if the VM changed the layout of the region and it has to be
+     * mapped again first.
+     */
+    const BYTE *BeginFrameRead(uint32_t &slot, uint64_t &seq);
+
+    /**
+     * @brief Checks whether the frame read since BeginFrameRead() was left alone by the VM.
+     *
+     * @returns Whether the pixels read are a consistent frame. Always true for version 5 VMs, whose flat framebuffer
+     * has no way of telling.
+     */
+    bool EndFrameRead(uint32_t slot, uint64_t seq);
+
+    /**
+     * @brief Adds a region back to the accumulated dirty region, so it is handed out again on the next drain.
+     *
+     * @param region The region to add.
+     */
+    void RestoreDirtyRegion(const REGION16 *region);
+
+    /**
+     * @brief Moves the accumulated dirty region into the region passed in, in a thread-safe manner.
+     *
+     * The accumulated region is empty once this returns, so every damaged rectangle is handed out exactly once.
+     *
+     * @param region The region to union the dirty rectangles into.
+     */
+    void DrainDirtyRegion(REGION16 *region);
+
+    /**
+     * @brief Gets the UUID of the VM associated with the listener.
+     */
+    const std::string &UUID();
+
+    /**
+     * @brief Gets the handle of the listener in the RDPServerWorker's ListenerTable.
+     */
+    uint32_t Handle();
+
+    /**
+     * @brief Sets the handle of the listener. Must be called before the listener starts running.
+     *
+     * @param handle The handle.
+     */
+    void Handle(uint32_t handle);
+
+    /**
+     * @brief Gets the port the listener was handed.
+     */
+    uint16_t Port();
+
+    /**
+     * @brief Gets the protocol version the VM speaks.
+     *
+     * @returns The protocol version the VM registered with.
+     */
+    int ProtocolVersion();
+
+    /**
+     * @brief Updates the mouse event counters exposed over DBus.
+     *
+     * @param forwarded Number of mouse messages sent to the VM.
+     * @param coalesced Number of motion events merged away before they were sent.
+     */
+    void CountMouseEvents(uint64_t forwarded, uint64_t coalesced);
+
+    /**
+     * @brief Adds the estimated cost of a frame that was sent to the clients to the estimates exposed over DBus. These
+     * are diagnostics only: nothing is encoded once for several clients.
+     *
+     * @param encodes Estimated number of encodes the clients do for the frame, each client encoding on its own.
+     * @param grouped Estimated number of encodes the frame would take if alike clients shared one.
+     * @param groups Number of groups of alike clients, going by their guessed codec and settings.
+     */
+    void EstimateEncodes(double encodes, double grouped, uint32_t groups);
+
+    /**
+     * @brief Gets the highest frame rate the VM is asked to draw at. Set over DBus as MaxFrameRate.
+     */
+    uint32_t MaxFrameRate();
+
+    /**
+     * @brief Gets the lowest frame rate the VM is asked to draw at, even while nobody is watching. Set over DBus as
+     * MinFrameRate. Never above MaxFrameRate().
+     */
+    uint32_t MinFrameRate();
+
+    /**
+     * @brief Gets the capture loop's latency profile. Set over DBus as Profile.
      */
-    std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> GetDirtyRegion();
+    FrameProfile Profile();
 
     /**
      * @brief See whether the listener was configured to authenticate connections
@@ -166,14 +354,45 @@ public:
     rdpShadowServer *server;
 
     /**
-     * @brief The shared memory region containing the framebuffer. Always 32 MB big.
+     * @brief The shared memory region containing the framebuffer. A flat framebuffer for version 5 VMs, and a
+     * ShmHeader followed by the frame slots for version 6 VMs.
      */
     void *shm_buffer;
 
+    /**
+     * @brief Header of the shared memory region, or nullptr for version 5 VMs.
+     */
+    ShmHeader *shm_header;
+
     bool listenerRunning();
 
 private:
 
+    /**
+     * @brief Maps the VM's shared memory region, opening it by name for VMs that didn't pass it at registration.
+     *
+     * @param frame_size Size in bytes of a frame of the VM's new geometry.
+     *
+     * @returns Whether there is a mapping that holds a whole frame.
+     */
+    bool mapFramebufferRegion(size_t frame_size);
+
+    /**
+     * @brief Maps the shared memory region behind fd in place of the current mapping, if it has grown. The current
+     * mapping is left alone if the new one can't be made.
+     *
+     * @param fd File descriptor of the region. Left open.
+     * @param frame_size Size in bytes of a frame of the VM's new geometry.
+     *
+     * @returns Whether there is a mapping that holds a whole frame.
+     */
+    bool mapRegion(int fd, size_t frame_size);
+
+    /**
+     * @brief Gets the RDP pixel formats and bytes per pixel for a pixman format, as GetRDPFormat() does.
+     */
+    static std::tuple<int, int, int> rdpFormat(pixman_format_code_t format);
+
     /**
      * @brief dbus introspection xml
      */
@@ -191,6 +410,11 @@ private:
      */
     RDPServerWorker *parent;
 
+    /**
+     * @brief The parent's copy pool, held so that it stays around for as long as this listener's capture thread does.
+     */
+    std::shared_ptr<ThreadPool> copy_pool;
+
     /**
      * @brief Port number to listen on.
      */
@@ -212,45 +436,138 @@ private:
     int vm_id;
 
     /**
-     * @brief mutex guarding dirty region dimensions
+     * @brief Protocol version the VM registered with. Decides how messages to and from the VM are encoded.
      */
-    std::mutex dimMutex;
+    const int protocol_version;
+
+    /**
+     * @brief Compact handle used to address the VM in the data plane.
+     */
+    uint32_t handle;
 
     /**
-     * @brief X coordinate of current dirty region
+     * @brief Keeps the dirty region off the cache lines of the fields around it.
+     *
+     * The dirty region is written by the ServerWorker thread and drained by the shadow subsystem thread on every
+     * tick, so it gets cache lines of its own.
      */
-    uint32_t x;
+    char damage_pad_front[RDPMUX_CACHELINE_SIZE];
 
     /**
-     * @brief Y coordinate of the current dirty region
+     * @brief mutex guarding the dirty region
      */
-    uint32_t y;
+    std::mutex dimMutex;
 
     /**
-     * @brief width of the current dirty region
+     * @brief Disjoint rectangles making up the damage accumulated since the last drain
      */
-    uint32_t w;
+    REGION16 dirty_region;
 
     /**
-     * @brief height of the current dirty region
+     * @brief See damage_pad_front.
      */
-    uint32_t h;
+    char damage_pad_back[RDPMUX_CACHELINE_SIZE];
 
     /**
-     * @brief The width of the framebuffer. Accessed via GetWidth().
+     * @brief The width of the framebuffer. Accessed via Width(). Only changed by MapFramebuffer(), so it always
+     * matches the mapping.
      */
     size_t width;
 
     /**
-     * @brief The height of the framebuffer. Accessed via GetHeight().
+     * @brief The height of the framebuffer. Accessed via Height(). Only changed by MapFramebuffer().
      */
     size_t height;
 
     /**
-     * @brief The pixel format of the framebuffer. Accessed via GetFormat().
+     * @brief The pixel format of the framebuffer. Accessed via Format(). Only changed by MapFramebuffer().
      */
     pixman_format_code_t format;
 
+    /**
+     * @brief Mutex guarding the geometry of the latest display switch, and setting shm_stale along with it.
+     */
+    std::mutex switchMutex;
+
+    /**
+     * @brief Geometry of the latest display switch, taken on by MapFramebuffer() once a mapping holds it.
+     */
+    size_t pending_width, pending_height;
+    pixman_format_code_t pending_format;
+
+    /**
+     * @brief Whether the mapping holds a whole frame of the current geometry. Only used by MapFramebuffer().
+     */
+    bool shm_fits;
+
+    /**
+     * @brief Memory file the VM passed in at registration, or -1 for VMs that share their framebuffer by name.
+     */
+    int shm_fd;
+
+    /**
+     * @brief Size in bytes of the mapping at shm_buffer.
+     */
+    size_t shm_size;
+
+    /**
+     * @brief Header size of the region when it was mapped. Frames are only ever located with this copy, since the VM
+     * can rewrite the header after it was checked.
+     */
+    uint64_t shm_header_size;
+
+    /**
+     * @brief Slot size of the region when it was mapped. The VM changing it means the region grew. Like
+     * shm_header_size, this copy is the one frames are located with.
+     */
+    uint64_t shm_slot_size;
+
+    /**
+     * @brief Set by a display switch, so that the framebuffer reader checks whether the mapping still fits. Set under
+     * switchMutex.
+     */
+    std::atomic<bool> shm_stale;
+
+    /**
+     * @brief How the VM backed its shared memory region, one of the RDPMUX_SHM_PAGES_* values.
+     */
+    std::atomic<uint32_t> shm_page_mode;
+
+    /**
+     * @brief Signaled when there is work for the shadow subsystem thread. Accessed via DamageEvent().
+     */
+    HANDLE damage_event;
+
+    /**
+     * @brief Signaled when the VM's cursor changed. Accessed via CursorEvent().
+     */
+    HANDLE cursor_event;
+
+    /**
+     * @brief Mutex guarding the cursor's state below.
+     */
+    std::mutex cursorMutex;
+
+    /**
+     * @brief Latest cursor shape from the VM.
+     */
+    CursorShape cursor;
+
+    /**
+     * @brief Whether the VM defined a cursor, and whether it changed since the subsystem last picked it up.
+     */
+    bool cursor_defined, cursor_shape_changed;
+
+    /**
+     * @brief Latest position of the VM's cursor.
+     */
+    uint32_t cursor_x, cursor_y;
+
+    /**
+     * @brief Whether the VM moved its cursor, and whether it moved since the subsystem last picked it up.
+     */
+    bool cursor_positioned, cursor_moved;
+
     /**
      * @brief Mutex guarding stop.
      */
@@ -270,15 +587,51 @@ private:
     bool authenticating;
 
     /**
-     * @brief Target FPS of the backend guest.
+     * @brief Highest frame rate the VM is asked to draw at. Accessed via MaxFrameRate().
      */
-    uint16_t targetFPS;
+    std::atomic<uint32_t> max_fps;
+
+    /**
+     * @brief Lowest frame rate the VM is asked to draw at. Accessed via MinFrameRate().
+     */
+    std::atomic<uint32_t> min_fps;
+
+    /**
+     * @brief Latency profile of the capture loop. Accessed via Profile().
+     */
+    std::atomic<FrameProfile> profile;
 
     /**
      * @brief Map holding set of authentication credentials
      */
     std::string credential_path;
 
+    /**
+     * @brief Number of mouse messages sent to the VM.
+     */
+    std::atomic<uint64_t> mouse_forwarded;
+
+    /**
+     * @brief Number of mouse motion events merged into a later one instead of being sent to the VM.
+     */
+    std::atomic<uint64_t> mouse_coalesced;
+
+    /**
+     * @brief Estimated number of frame encodes done for the clients, in thousandths of an encode.
+     */
+    std::atomic<uint64_t> estimated_encodes;
+
+    /**
+     * @brief Estimated number of frame encodes the clients would have needed with one encode per group of alike
+     * clients, in thousandths of an encode.
+     */
+    std::atomic<uint64_t> estimated_encodes_if_grouped;
+
+    /**
+     * @brief Number of groups of alike clients as of the last frame, going by their guessed codec and settings.
+     */
+    std::atomic<uint32_t> estimated_peer_groups;
+
     /**
     * @brief Method called when a DBus method call is invoked.
     */
@@ -299,6 +652,18 @@ private:
                           const Glib::ustring&,
                           const Glib::ustring&,
                           const Glib::ustring& property_name);
+
+    /**
+     * @brief DBus property setter for this object.
+     *
+     * @returns Whether the property was set.
+     */
+    bool on_set_property(const Glib::RefPtr<Gio::DBus::Connection>&,
+                         const Glib::ustring&,
+                         const Glib::ustring&,
+                         const Glib::ustring&,
+                         const Glib::ustring& property_name,
+                         const Glib::VariantBase& value);
 };
 
 #endif //QEMU_RDP_RDPLISTENER_H
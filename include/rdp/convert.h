@@ -0,0 +1,70 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_RDP_CONVERT_H
+#define QEMU_RDP_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <pixman.h>
+
+/**
+ * @brief Copies a rectangle of VM framebuffer pixels into a 32-bit XRGB surface, converting them on the way.
+ *
+ * @param dst First pixel of the rectangle in the destination surface.
+ * @param dst_step Scanline of the destination surface.
+ * @param src First pixel of the rectangle in the VM's framebuffer.
+ * @param src_step Scanline of the VM's framebuffer.
+ * @param width Width of the rectangle in pixels.
+ * @param height Height of the rectangle in pixels.
+ */
+typedef void (*rdpmux_convert_fn)(uint8_t *dst, size_t dst_step, const uint8_t *src, size_t src_step, size_t width,
+                                  size_t height);
+
+/**
+ * @brief Gets the fastest conversion from a VM framebuffer format to XRGB32 this CPU can run.
+ *
+ * The CPU is probed once, on the first call. Formats that are already 32 bits wide have no conversion of their own,
+ * since copying them is a memcpy anyway.
+ *
+ * @param format The pixman format of the VM's framebuffer.
+ *
+ * @returns The conversion, or nullptr if the format has none.
+ */
+rdpmux_convert_fn rdpmux_get_converter(pixman_format_code_t format);
+
+/**
+ * @brief Instruction sets the conversions are written for, from slowest to fastest.
+ */
+enum class ConvertISA {
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512BW,
+};
+
+/**
+ * @brief Gets the conversion from a VM framebuffer format to XRGB32 written for one instruction set. This lets the
+ * tests hold every instruction set this CPU can run against the scalar conversions.
+ *
+ * @param format The pixman format of the VM's framebuffer.
+ * @param isa The instruction set.
+ *
+ * @returns The conversion, or nullptr if the format has none or this CPU can't run the instruction set.
+ */
+rdpmux_convert_fn rdpmux_get_converter(pixman_format_code_t format, ConvertISA isa);
+
+#endif //QEMU_RDP_CONVERT_H
@@ -13,6 +13,11 @@ typedef struct rdpmux_shadow_subsystem {
     RDPListener *listener;
     size_t src_width;
     size_t src_height;
+    bool borrow_framebuffer; // let the surface read frames straight from shared memory when it can
+    BYTE *surface_data; // the surface's own buffer while it borrows a frame slot, otherwise NULL
+    UINT32 target_fps; // frame rate the VM was last asked to draw at
+    rdpShadowClient *last_mouse_client; // client that moved the mouse last, which shows its own cursor where it is
+    HANDLE thread; // capture thread, joined by rdpmux_subsystem_stop()
 } rdpmuxShadowSubsystem;
 
 FREERDP_API int RDPMux_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS *pEntryPoints);
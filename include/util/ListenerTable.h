@@ -0,0 +1,124 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_RDP_LISTENERTABLE_H
+#define QEMU_RDP_LISTENERTABLE_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "common.h"
+
+class RDPListener;
+
+/**
+ * @brief Gets the slot index of a VM handle.
+ */
+inline uint16_t HandleSlot(uint32_t handle)
+{
+    return handle & 0xffff;
+}
+
+/**
+ * @brief Table mapping compact VM handles to RDPListeners.
+ *
+ * A handle is a slot index in its low 16 bits and the generation of that slot in its high 16 bits. The generation is
+ * bumped whenever a slot is freed, so a stale handle never resolves to a listener that reused its slot. No valid
+ * handle is 0.
+ *
+ * Registration and unregistration build a new immutable snapshot of the table and bump its version. Readers keep a
+ * snapshot of their own through a ListenerTableReader and only take the table's lock when the version moved, so the
+ * lookups done for every message are a version check and an array index.
+ */
+class ListenerTable
+{
+public:
+    struct Entry {
+        /**
+         * @brief Handle currently occupying the slot, or 0 if the slot is free.
+         */
+        uint32_t handle;
+        std::weak_ptr<RDPListener> listener;
+    };
+
+    typedef std::vector<Entry> Snapshot;
+
+    ListenerTable();
+
+    /**
+     * @brief Adds a listener to the table.
+     *
+     * @returns The listener's handle, or 0 if every slot is taken.
+     */
+    uint32_t Insert(std::shared_ptr<RDPListener> listener);
+
+    /**
+     * @brief Removes the listener with the given handle from the table. Does nothing if the handle is stale.
+     */
+    void Remove(uint32_t handle);
+
+    /**
+     * @brief Gets the version of the current snapshot. Bumped by every Insert() and Remove().
+     */
+    uint64_t Version();
+
+    /**
+     * @brief Gets the current snapshot.
+     *
+     * @param version Filled in with the version of the returned snapshot.
+     */
+    std::shared_ptr<const Snapshot> Load(uint64_t &version);
+
+private:
+    std::mutex lock;
+    std::shared_ptr<const Snapshot> current;
+    std::atomic<uint64_t> version;
+
+    /**
+     * @brief Current generation of every slot ever used, including free ones.
+     */
+    std::vector<uint16_t> generations;
+
+    /**
+     * @brief Slots freed by Remove(), reused before the table grows.
+     */
+    std::vector<uint16_t> free_slots;
+};
+
+/**
+ * @brief Per-thread cached view of a ListenerTable.
+ *
+ * Not thread safe; every thread that looks up listeners should have a reader of its own.
+ */
+class ListenerTableReader
+{
+public:
+    explicit ListenerTableReader(ListenerTable &table);
+
+    /**
+     * @brief Looks up a listener by handle.
+     *
+     * @returns The listener, or nullptr if the handle is stale or the listener is gone.
+     */
+    std::shared_ptr<RDPListener> Find(uint32_t handle);
+
+private:
+    ListenerTable &table;
+    uint64_t version;
+    std::shared_ptr<const ListenerTable::Snapshot> snapshot;
+};
+
+#endif //QEMU_RDP_LISTENERTABLE_H
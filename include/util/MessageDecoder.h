@@ -0,0 +1,76 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_RDP_MESSAGEDECODER_H
+#define QEMU_RDP_MESSAGEDECODER_H
+
+#include "common.h"
+
+/**
+ * @brief Decodes a msgpack-encoded message from the VM in place.
+ *
+ * Messages from the VM are msgpack arrays of unsigned integers. This reads them straight out of the buffer they were
+ * received into, without going through a msgpack::unpacked or any other intermediate allocation.
+ *
+ * @param buf The encoded message.
+ * @param len Size of buf in bytes.
+ * @param msg Filled in with the decoded message on success.
+ *
+ * @returns Whether buf held a well-formed message of at most RDPMUX_MAX_MESSAGE_LENGTH values.
+ */
+bool DecodeMessage(const void *buf, size_t len, VMMessage &msg);
+
+/**
+ * @brief Decodes a protocol version 6 message from the VM in place.
+ *
+ * Version 6 messages are a little-endian uint32_t type and payload length, followed by the payload as little-endian
+ * uint32_ts. The values come out in the same order as their version 5 counterparts.
+ *
+ * @param buf The encoded message.
+ * @param len Size of buf in bytes.
+ * @param msg Filled in with the decoded message on success.
+ *
+ * @returns Whether buf held a well-formed message of at most RDPMUX_MAX_MESSAGE_LENGTH values.
+ */
+bool DecodeWireMessage(const void *buf, size_t len, VMMessage &msg);
+
+/**
+ * @brief Decodes a protocol version 6 CURSOR_DEFINE message from the VM.
+ *
+ * The payload is the hotspot and size of the cursor, followed by its pixels as little-endian a8r8g8b8 values.
+ *
+ * @param buf The encoded message.
+ * @param len Size of buf in bytes.
+ * @param shape Filled in with the decoded shape on success. Its pixel buffer is reused, so decoding into the same
+ * shape over and over only allocates when a cursor is bigger than any before it.
+ *
+ * @returns Whether buf held a well-formed cursor no bigger than RDPMUX_MAX_CURSOR_SIZE in either direction.
+ */
+bool DecodeCursorDefine(const void *buf, size_t len, CursorShape &shape);
+
+/**
+ * @brief Encodes a message to the VM in the protocol version 6 layout.
+ *
+ * @param values The message values, message type first.
+ * @param count Number of entries in values.
+ * @param buf Buffer to write the message to.
+ * @param size Size of buf in bytes.
+ *
+ * @returns Number of bytes written, or 0 if buf is too small.
+ */
+size_t EncodeWireMessage(const uint32_t *values, size_t count, uint8_t *buf, size_t size);
+
+#endif //QEMU_RDP_MESSAGEDECODER_H
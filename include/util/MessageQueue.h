@@ -18,49 +18,115 @@
 #define QEMU_RDP_MESSAGEQUEUE_H
 
 #include "common.h"
-#include <msgpack/sbuffer.hpp>
-#include <mutex>
-#include <condition_variable>
-#include <queue>
+#include <atomic>
+#include <memory>
 
-typedef std::tuple<std::vector<uint16_t>, std::string> QueueItem;
+/**
+ * @brief Maximum number of values in a message to the VM: the type, plus at most three arguments.
+ */
+#define RDPMUX_MAX_OUTGOING_LENGTH 4
+
+/**
+ * @brief Default number of records a MessageQueue can hold.
+ */
+#define RDPMUX_QUEUE_CAPACITY 1024
 
 /**
- * @brief A synchronized FIFO queue backed by an std::queue to hold msgpack::sbufs for processing.
+ * @brief A fixed-size outgoing message to the VM.
+ *
+ * Records are copied in and out of the queue whole, so queueing a message never allocates.
+ */
+struct QueueItem {
+    /**
+     * @brief Number of valid entries in data.
+     */
+    uint32_t length;
+
+    /**
+     * @brief The message values. data[0] holds the message type.
+     */
+    uint32_t data[RDPMUX_MAX_OUTGOING_LENGTH];
+
+    /**
+     * @brief Handle of the VM the message is for.
+     */
+    uint32_t handle;
+};
+
+/**
+ * @brief A bounded lock-free multi-producer single-consumer ring of QueueItems.
+ *
+ * Any thread may enqueue, but only one thread may dequeue. Every slot carries a sequence number that tells producers
+ * and the consumer whose turn it is to touch the slot, so producers only ever contend on a single atomic counter and
+ * never block. When the ring is full, new items are dropped and counted rather than waited on.
  */
 class MessageQueue
 {
 public:
-    MessageQueue() {};
-    ~MessageQueue() {};
+    /**
+     * @brief Creates an empty queue.
+     *
+     * @param capacity Number of records the queue can hold. Rounded up to a power of two.
+     */
+    explicit MessageQueue(size_t capacity = RDPMUX_QUEUE_CAPACITY);
 
     /**
-     * @brief Checks if the queue is empty.
+     * @brief Checks if the queue is empty. May only be called by the consumer.
      *
      * @returns Whether the queue is empty.
      */
-    bool isEmpty() {
-        return queue_.empty();
-    }
+    bool isEmpty();
 
     /**
-     * @brief Enqueues an item on the queue
+     * @brief Enqueues an item on the queue without blocking.
      *
      * @param item The item to place in the queue.
+     *
+     * @returns Whether the item was queued. False means the queue was full and the item was dropped.
      */
-    void enqueue(QueueItem item);
+    bool enqueue(const QueueItem &item);
 
     /**
-     * @brief Dequeue the next item in the queue.
+     * @brief Dequeue the next item in the queue without blocking. May only be called by the consumer.
+     *
+     * @param item Filled in with the dequeued item on success.
      *
-     * @returns Reference to the dequeued item.
+     * @returns Whether an item was dequeued.
+     */
+    bool tryDequeue(QueueItem &item);
+
+    /**
+     * @brief Gets the number of items successfully queued since creation.
+     */
+    uint64_t Enqueued();
+
+    /**
+     * @brief Gets the number of items dropped because the queue was full since creation.
      */
-    const QueueItem dequeue();
+    uint64_t Dropped();
 
 private:
-    std::mutex mutex_;
-    std::condition_variable cond_push_;
-    std::queue<QueueItem> queue_;
+    struct Cell {
+        std::atomic<size_t> sequence;
+        QueueItem item;
+    };
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    /**
+     * @brief Keeps the producer counters off the cache lines of the consumer position and the cell pointer.
+     */
+    char pad_front[RDPMUX_CACHELINE_SIZE];
+    std::atomic<size_t> enqueue_pos;
+    std::atomic<uint64_t> enqueued;
+    std::atomic<uint64_t> dropped;
+    char pad_back[RDPMUX_CACHELINE_SIZE];
+
+    /**
+     * @brief Position of the next item to dequeue. Only touched by the consumer.
+     */
+    size_t dequeue_pos;
 };
 
 #endif //QEMU_RDP_MESSAGEQUEUE_H
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_RDP_PORTPOOL_H
+#define QEMU_RDP_PORTPOOL_H
+
+#include <deque>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "common.h"
+
+/**
+ * @brief Hands out listener ports from a fixed range.
+ *
+ * Ports in use are tracked in a bitmap, and free ports are kept in a FIFO so that a released port is the last one to
+ * be handed out again. Handing out a port is O(1): only the port at the head of the FIFO is checked for use by other
+ * processes, and that check runs without holding the pool's lock, so concurrent registrations don't wait on each
+ * other's bind() calls.
+ */
+class PortPool
+{
+public:
+    /**
+     * @brief Creates a pool of every port from first to last, inclusive.
+     */
+    PortPool(uint16_t first, uint16_t last);
+
+    /**
+     * @brief Takes a free port out of the pool.
+     *
+     * Ports found to be bound by another process are put back at the tail of the FIFO and the next one is tried.
+     *
+     * @returns The port, or 0 if no port in the range could be bound.
+     */
+    uint16_t Acquire();
+
+    /**
+     * @brief Takes a specific port out of the pool.
+     *
+     * Ports outside the range can be reserved too, they are just never handed out by Acquire().
+     *
+     * @returns Whether the port was free.
+     */
+    bool Reserve(uint16_t port);
+
+    /**
+     * @brief Returns a port to the pool.
+     */
+    void Release(uint16_t port);
+
+private:
+    /**
+     * @brief Checks whether a port can currently be bound on all interfaces.
+     */
+    static bool probe(uint16_t port);
+
+    bool inRange(uint16_t port);
+    bool getBit(const std::vector<uint64_t> &bits, uint16_t port);
+    void setBit(std::vector<uint64_t> &bits, uint16_t port, bool value);
+
+    std::mutex lock;
+    const uint16_t first;
+    const uint16_t last;
+
+    /**
+     * @brief One bit per port in the range, set while the port is handed out.
+     */
+    std::vector<uint64_t> used;
+
+    /**
+     * @brief One bit per port in the range, set while the port is in free_list, so that no port is ever in it twice.
+     */
+    std::vector<uint64_t> queued;
+
+    /**
+     * @brief Free ports in the order they should be handed out. May hold ports that were since reserved; those are
+     * skipped when they reach the head. Holds every port at most once, so it never outgrows the range.
+     */
+    std::deque<uint16_t> free_list;
+
+    /**
+     * @brief Reserved ports outside the range.
+     */
+    std::set<uint16_t> outside;
+};
+
+#endif //QEMU_RDP_PORTPOOL_H
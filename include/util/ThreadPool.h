@@ -0,0 +1,81 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_RDP_THREADPOOL_H
+#define QEMU_RDP_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed set of worker threads that help out with work split into independent pieces.
+ *
+ * The pool is shared by every listener's capture thread. A caller hands its pieces to the pool with ParallelFor() and
+ * works through them itself alongside the workers, so a caller never waits on a pool that is busy with somebody
+ * else's pieces: at worst it does all of its own.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @brief Starts the worker threads.
+     *
+     * @param num_threads Number of workers. With none, ParallelFor() runs everything on the calling thread.
+     */
+    explicit ThreadPool(unsigned int num_threads);
+
+    /**
+     * @brief Stops and joins the worker threads. Pieces nobody has picked up yet are dropped, which is only safe once
+     * no ParallelFor() call is running any more.
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @brief Calls fn(i) for every i in [0, count), spread across the calling thread and the workers, and returns
+     * once all of the calls returned.
+     */
+    void ParallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+    /**
+     * @brief Gets the number of worker threads, not counting the threads calling ParallelFor().
+     */
+    size_t Size() const;
+
+private:
+    /**
+     * @brief Worker thread body. Runs queued jobs until the pool is destroyed.
+     */
+    void run();
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wakeup;
+
+    /**
+     * @brief Jobs waiting for a worker. Each job works through the pieces of one ParallelFor() call.
+     */
+    std::deque<std::function<void()>> jobs;
+    bool stopping;
+};
+
+#endif //QEMU_RDP_THREADPOOL_H
@@ -18,15 +18,20 @@ typedef struct InputEventCallbacks {
 
 typedef struct mux_display MuxDisplay;
 
+pixman_image_t *mux_display_create_surface(pixman_format_code_t format, int width, int height);
 void mux_display_update(int x, int y, int w, int h);
 void mux_display_switch(pixman_image_t *surface);
 uint32_t mux_display_refresh();
+uint64_t mux_get_bytes_copied(void);
+bool mux_cursor_define(int hot_x, int hot_y, int width, int height, const uint32_t *pixels);
+void mux_cursor_move(int x, int y);
 
 void *mux_mainloop(void *arg);
 void mux_out_loop();
 void *mux_display_buffer_update_loop(void *arg);
 
 void mux_register_event_callbacks(InputEventCallbacks cb);
+void mux_set_huge_pages(bool enable);
 MuxDisplay *mux_init_display_struct(const char *uuid);
 bool mux_connect(const char *path);
 bool mux_get_socket_path(const char *name, const char *obj, char **out_path, int id, uint16_t port, const char *auth);
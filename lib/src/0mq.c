@@ -29,11 +29,11 @@ int mux_0mq_recv_msg(void **buf)
     identity = zmsg_pop(msg);
     //zframe_print(identity, "F: ");
 
-    if (!zframe_streq(identity, display->uuid)) {
-        char *wrong = zframe_strdup(identity);
-        mux_printf_error("Incorrect UUID: %s", wrong);
-        free(wrong);
+    if (zframe_size(identity) != sizeof(display->handle) ||
+        memcmp(zframe_data(identity), &display->handle, sizeof(display->handle)) != 0) {
+        mux_printf_error("Message for a different VM handle received");
         zframe_destroy(&identity);
+        zmsg_destroy(&msg);
         return -1;
     }
 
@@ -45,6 +45,7 @@ int mux_0mq_recv_msg(void **buf)
 
     zframe_destroy(&identity);
     zframe_destroy(&data);
+    zmsg_destroy(&msg);
 
     return len;
 }
@@ -64,7 +65,7 @@ int mux_0mq_send_msg(void *buf, size_t len)
     zmsg_t *msg = zmsg_new();
 
     mux_printf("Now attempting to send message!");
-    zmsg_addstr(msg, display->uuid);
+    zmsg_addmem(msg, &display->handle, sizeof(display->handle));
     zmsg_addmem(msg, buf, len);
 
     if (zmsg_size(msg) != 2) {
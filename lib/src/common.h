@@ -16,7 +16,6 @@
 #include <pixman.h>
 
 #include "lib/libqueue.h"
-#include "lib/c-msgpack.h"
 
 /**
  * @brief Used to define publicly available functions.
@@ -25,8 +24,11 @@
 
 /**
  * @brief Protocol version.
+ *
+ * Version 5 encoded messages as msgpack arrays. Version 6 sends the fixed-layout little-endian structs described
+ * below, which librdpmux writes and reads without any serialization step.
  */
-#define RDPMUX_PROTOCOL_VERSION 5
+#define RDPMUX_PROTOCOL_VERSION 6
 
 /**
  * @brief debug output macro
@@ -65,16 +67,46 @@ typedef enum message_type {
     MOUSE,
     KEYBOARD,
     DISPLAY_UPDATE_COMPLETE,
-    SHUTDOWN
+    SHUTDOWN,
+    CURSOR_DEFINE,
+    CURSOR_MOVE
 } MessageType;
 
 /**
- * @brief Parameters for a display update event.
+ * @brief Maximum number of disjoint rectangles carried by a single display update.
  *
- * Display updates carry coordinates for a rectangular screen region, denoted as the coordinates of the top left corner
- * and the coordinates of the bottom right corner. All values are in px.
+ * Once this many rectangles are tracked, new damage is merged into whichever existing rectangle grows the least.
  */
-typedef struct display_update {
+#define MUX_MAX_DAMAGE_RECTS 16
+
+/**
+ * @brief Largest cursor width and height in px. RDP clients only have to support cursors up to this size.
+ */
+#define MUX_MAX_CURSOR_SIZE 96
+
+/**
+ * @brief Ways of copying damage into a frame slot. mux_shm_publish() picks the cheapest one for every frame.
+ */
+typedef enum mux_copy_strategy {
+    /**
+     * @brief One memcpy of every full row from the first damaged row to the last.
+     */
+    MUX_COPY_SPAN,
+    /**
+     * @brief One memcpy per band of full rows that hold damage.
+     */
+    MUX_COPY_BANDS,
+    /**
+     * @brief One memcpy per row of each damaged rectangle, covering only its columns.
+     */
+    MUX_COPY_RECTS,
+} mux_copy_strategy;
+
+/**
+ * @brief A rectangular screen region, denoted as the coordinates of the top left corner and the coordinates of the
+ * bottom right corner. All values are in px.
+ */
+typedef struct display_rect {
     /**
      * @brief X-coordinate of top left corner of region
      */
@@ -88,9 +120,25 @@ typedef struct display_update {
      */
     int x2;
     /**
-     * @brief X-coordinate of bottom right corner of region
+     * @brief Y-coordinate of bottom right corner of region
      */
     int y2;
+} display_rect;
+
+/**
+ * @brief Parameters for a display update event.
+ *
+ * Display updates carry a bounded list of disjoint rectangular screen regions that changed since the last update.
+ */
+typedef struct display_update {
+    /**
+     * @brief Number of valid entries in rects.
+     */
+    int num_rects;
+    /**
+     * @brief Disjoint dirty regions.
+     */
+    display_rect rects[MUX_MAX_DAMAGE_RECTS];
 } display_update;
 
 /**
@@ -163,6 +211,32 @@ typedef struct update_ack {
     uint32_t framerate;
 } update_ack;
 
+/**
+ * @brief The shape of the hypervisor's cursor.
+ */
+typedef struct mux_cursor {
+    /**
+     * @brief X-coordinate of the cursor's hotspot, relative to its top left corner.
+     */
+    int hot_x;
+    /**
+     * @brief Y-coordinate of the cursor's hotspot, relative to its top left corner.
+     */
+    int hot_y;
+    /**
+     * @brief Width of the cursor in px.
+     */
+    int width;
+    /**
+     * @brief Height of the cursor in px.
+     */
+    int height;
+    /**
+     * @brief The cursor's pixels, row by row without padding, as a8r8g8b8 with straight alpha.
+     */
+    uint32_t pixels[MUX_MAX_CURSOR_SIZE * MUX_MAX_CURSOR_SIZE];
+} mux_cursor;
+
 /**
  * @brief Parameters for a shutdown event.
  */
@@ -170,6 +244,178 @@ typedef struct shut_down {
     bool shutting_down;
 } shut_down;
 
+/**
+ * @brief Header that starts every message on the wire.
+ *
+ * All wire structs are made of little-endian uint32_ts, so they have no padding and can be sent as-is.
+ */
+typedef struct mux_wire_header {
+    /**
+     * @brief MessageType of the message.
+     */
+    uint32_t type;
+    /**
+     * @brief Size in bytes of the payload following the header.
+     */
+    uint32_t length;
+} mux_wire_header;
+
+/**
+ * @brief One dirty rectangle in a DISPLAY_UPDATE message.
+ */
+typedef struct mux_wire_rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} mux_wire_rect;
+
+/**
+ * @brief DISPLAY_UPDATE message. Only as many rects as the header length covers are sent.
+ */
+typedef struct mux_wire_display_update {
+    mux_wire_header header;
+    mux_wire_rect rects[MUX_MAX_DAMAGE_RECTS];
+} mux_wire_display_update;
+
+/**
+ * @brief DISPLAY_SWITCH message.
+ */
+typedef struct mux_wire_display_switch {
+    mux_wire_header header;
+    uint32_t format;
+    uint32_t w;
+    uint32_t h;
+} mux_wire_display_switch;
+
+/**
+ * @brief MOUSE message.
+ */
+typedef struct mux_wire_mouse {
+    mux_wire_header header;
+    uint32_t x;
+    uint32_t y;
+    uint32_t flags;
+} mux_wire_mouse;
+
+/**
+ * @brief KEYBOARD message.
+ */
+typedef struct mux_wire_kb {
+    mux_wire_header header;
+    uint32_t keycode;
+    uint32_t flags;
+} mux_wire_kb;
+
+/**
+ * @brief DISPLAY_UPDATE_COMPLETE message.
+ */
+typedef struct mux_wire_update_ack {
+    mux_wire_header header;
+    uint32_t success;
+    uint32_t framerate;
+} mux_wire_update_ack;
+
+/**
+ * @brief CURSOR_DEFINE message. Only as many pixels as the header length covers are sent.
+ */
+typedef struct mux_wire_cursor_define {
+    mux_wire_header header;
+    uint32_t hot_x;
+    uint32_t hot_y;
+    uint32_t w;
+    uint32_t h;
+    uint32_t pixels[MUX_MAX_CURSOR_SIZE * MUX_MAX_CURSOR_SIZE];
+} mux_wire_cursor_define;
+
+/**
+ * @brief CURSOR_MOVE message.
+ */
+typedef struct mux_wire_cursor_move {
+    mux_wire_header header;
+    uint32_t x;
+    uint32_t y;
+} mux_wire_cursor_move;
+
+/**
+ * @brief Size of the biggest message librdpmux sends.
+ */
+#define MUX_MAX_MSG_SIZE sizeof(mux_wire_cursor_define)
+
+/**
+ * @brief Magic number at the start of the shared memory region, "RMUX" in little-endian.
+ */
+#define MUX_SHM_MAGIC 0x584d5552
+
+/**
+ * @brief Number of frame slots in the shared memory region.
+ */
+#define MUX_SHM_SLOTS 2
+
+/**
+ * @brief Offset of the first frame slot in the shared memory region. The header lives in front of it.
+ */
+#define MUX_SHM_HEADER_SIZE 4096
+
+/**
+ * @brief The shared memory region is backed by normal pages.
+ */
+#define MUX_SHM_PAGES_NORMAL 0
+
+/**
+ * @brief The shared memory region is backed by shmem that the kernel may back with transparent huge pages.
+ */
+#define MUX_SHM_PAGES_TRANSPARENT 1
+
+/**
+ * @brief The shared memory region is backed by hugetlbfs pages.
+ */
+#define MUX_SHM_PAGES_HUGETLB 2
+
+/**
+ * @brief Header at the start of the shared memory region.
+ *
+ * The region holds MUX_SHM_SLOTS complete copies of the framebuffer. librdpmux only ever writes to a slot that isn't
+ * front, and flips front once the slot is complete, so the server always reads a whole frame. Each slot has a sequence
+ * number that is odd while the slot is being written; the server checks it before and after reading a slot, and
+ * retries if it changed in between.
+ */
+typedef struct mux_shm_header {
+    /**
+     * @brief Always MUX_SHM_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * @brief Number of frame slots.
+     */
+    uint32_t num_slots;
+    /**
+     * @brief Offset in bytes of the first frame slot.
+     */
+    uint64_t header_size;
+    /**
+     * @brief Size in bytes of each frame slot. Grows when the framebuffer outgrows it; the server remaps the region
+     * once it gets the DISPLAY_SWITCH for the new framebuffer.
+     */
+    uint64_t slot_size;
+    /**
+     * @brief Number of frames published so far.
+     */
+    uint64_t frame_seq;
+    /**
+     * @brief Index of the slot holding the most recently published frame.
+     */
+    uint32_t front;
+    /**
+     * @brief How the region is backed, one of the MUX_SHM_PAGES_* values. Set when the region is created.
+     */
+    uint32_t page_mode;
+    /**
+     * @brief Per-slot sequence numbers. Odd while the slot is being written.
+     */
+    uint64_t slot_seq[MUX_SHM_SLOTS];
+} mux_shm_header;
+
 /**
  * @brief Object to hold information about the various types of events.
  *
@@ -198,6 +444,35 @@ typedef struct MuxUpdate {
     };
 } MuxUpdate;
 
+/**
+ * @brief Fingerprints of the framebuffer's contents, one per square tile.
+ *
+ * Hypervisors often report damage for regions they repainted with the same pixels. Checking the tiles under the
+ * reported damage against their last fingerprint lets librdpmux drop the parts that didn't actually change.
+ */
+typedef struct mux_tile_map {
+    /**
+     * @brief Width of the framebuffer in px.
+     */
+    int width;
+    /**
+     * @brief Height of the framebuffer in px.
+     */
+    int height;
+    /**
+     * @brief Number of tile columns.
+     */
+    int cols;
+    /**
+     * @brief Number of tile rows.
+     */
+    int rows;
+    /**
+     * @brief Hash of each tile's pixels, row by row. 0 for tiles whose contents aren't known.
+     */
+    uint64_t *hashes;
+} mux_tile_map;
+
 /**
  * @brief queue to hold ShimUpdate objects.
  *
@@ -229,10 +504,67 @@ struct mux_display {
      * @brief File descriptor of the shared memory region.
      */
     int shmem_fd;
+    /**
+     * @brief Whether to try backing the shared memory region with huge pages. Set via mux_set_huge_pages().
+     */
+    bool huge_pages;
+    /**
+     * @brief How the shared memory region is backed, one of the MUX_SHM_PAGES_* values.
+     */
+    uint32_t page_mode;
+    /**
+     * @brief Size in bytes of the pages backing the shared memory region. Its size is always a multiple of this.
+     */
+    size_t page_size;
     /**
      * @brief pointer to the shared memory region.
      */
     void *shm_buffer;
+    /**
+     * @brief Size in bytes of the shared memory region.
+     */
+    size_t shm_size;
+    /**
+     * @brief Mapping replaced by the last time the region grew, or NULL. Unmapped on the next display switch.
+     */
+    void *retired_shm_buffer;
+    /**
+     * @brief Size in bytes of retired_shm_buffer.
+     */
+    size_t retired_shm_size;
+    /**
+     * @brief Whether the current surface lives in the shared memory region.
+     */
+    bool direct;
+    /**
+     * @brief Header at the start of the shared memory region.
+     */
+    mux_shm_header *shm_header;
+    /**
+     * @brief Damage written by the last publish. The slot that wasn't published is missing exactly this, so it is
+     * copied again on the next publish.
+     */
+    display_rect prev_rects[MUX_MAX_DAMAGE_RECTS];
+    /**
+     * @brief Number of valid entries in prev_rects.
+     */
+    int num_prev_rects;
+    /**
+     * @brief Measured cost of copying one byte, in ns. Set by mux_calibrate_copy().
+     */
+    double copy_ns_per_byte;
+    /**
+     * @brief Measured cost of starting a memcpy on a new row, in ns. Set by mux_calibrate_copy().
+     */
+    double copy_ns_per_call;
+    /**
+     * @brief Bytes copied into the shared memory region so far. Read with mux_get_bytes_copied().
+     */
+    uint64_t bytes_copied;
+    /**
+     * @brief Fingerprints of the current surface, used to drop damage that didn't change any pixels.
+     */
+    mux_tile_map tiles;
     /**
      * @brief Current dirty update
      */
@@ -253,6 +585,12 @@ struct mux_display {
      */
     const char *uuid;
 
+    /**
+     * @brief Handle assigned to the VM by the server during registration, stored little-endian. Sent in place of
+     * the UUID with every message.
+     */
+    uint32_t handle;
+
     /**
      * @brief current framerate target of the VM guest. Comes from the server.
      */
@@ -267,6 +605,26 @@ struct mux_display {
      * @brief Boolean representing ready state of out_update.
      */
     bool out_ready;
+
+    /**
+     * @brief Latest cursor shape. Guarded by out_lock.
+     */
+    mux_cursor cursor;
+
+    /**
+     * @brief Whether cursor holds a shape the server hasn't been sent yet. Guarded by out_lock.
+     */
+    bool cursor_defined;
+
+    /**
+     * @brief Latest cursor position in px. Guarded by out_lock.
+     */
+    int cursor_x, cursor_y;
+
+    /**
+     * @brief Whether the cursor moved since its position was last sent to the server. Guarded by out_lock.
+     */
+    bool cursor_moved;
 };
 typedef struct mux_display MuxDisplay;
 
@@ -1,4 +1,9 @@
 /** @file */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <gio/gunixfdlist.h>
 #include "dbus.h"
 
 /*
@@ -7,10 +12,130 @@
  * put sockets in a ridiculous place, though that will probably happen sometime.
  */
 
+/**
+ * @brief Checks whether the kernel backs shmem with transparent huge pages, at least where a mapping asks for them.
+ */
+static bool mux_shmem_thp_enabled(void)
+{
+    char mode[128];
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (f == NULL)
+        return false;
+
+    size_t len = fread(mode, 1, sizeof(mode) - 1, f);
+    fclose(f);
+    mode[len] = '\0';
+
+    // the active setting is the one in brackets
+    return strstr(mode, "[always]") || strstr(mode, "[within_size]") || strstr(mode, "[advise]") ||
+           strstr(mode, "[force]");
+}
+
+/**
+ * @brief Gets the size of a transparent huge page.
+ */
+static size_t mux_thp_size(void)
+{
+    unsigned long size = 0;
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lu", &size) != 1)
+            size = 0;
+        fclose(f);
+    }
+
+    return size ? size : 2 * 1024 * 1024;
+}
+
+/**
+ * @brief Creates a memory file backed by hugetlbfs pages.
+ *
+ * A page is reserved and released right away, so that a system without free huge pages is caught here, where falling
+ * back to normal pages is still possible, rather than on the first display switch.
+ *
+ * @returns File descriptor of the sealed memory file, or -1 if huge pages can't be had.
+ */
+static int mux_create_hugetlb_fd(void)
+{
+#ifdef MFD_HUGETLB
+    struct stat st;
+    void *probe = MAP_FAILED;
+    int fd = memfd_create("rdpmux-framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+    if (fd < 0) {
+        mux_printf("hugetlbfs memfd unavailable: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == 0 && ftruncate(fd, st.st_blksize) == 0)
+        probe = mmap(NULL, st.st_blksize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (probe == MAP_FAILED || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+        mux_printf("hugetlbfs pages unavailable: %s", strerror(errno));
+        if (probe != MAP_FAILED)
+            munmap(probe, st.st_blksize);
+        close(fd);
+        return -1;
+    }
+
+    munmap(probe, st.st_blksize);
+    display->page_size = st.st_blksize;
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief Creates the anonymous memory file backing the shared framebuffer.
+ *
+ * The file has no name, so nothing is left behind in /dev/shm when the VM goes away; it is freed once both the VM and
+ * the server have closed it. It is sealed against shrinking so that the server can't be made to fault by truncating it
+ * under its mapping. It starts out empty and is sized on the first display switch.
+ *
+ * If huge pages were asked for, hugetlbfs is tried first, then transparent huge pages, then normal pages. The mode the
+ * file ended up with is recorded in the display and, once the region is mapped, in its header.
+ *
+ * @returns File descriptor of the memory file, or -1 on failure.
+ */
+static int mux_create_framebuffer_fd(void)
+{
+    int fd;
+
+    if (display->huge_pages && (fd = mux_create_hugetlb_fd()) >= 0) {
+        display->page_mode = MUX_SHM_PAGES_HUGETLB;
+        mux_printf("Framebuffer is backed by %zu byte hugetlbfs pages", display->page_size);
+        return fd;
+    }
+
+    fd = memfd_create("rdpmux-framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        mux_printf_error("memfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+        mux_printf_error("sealing the framebuffer failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (display->huge_pages && mux_shmem_thp_enabled()) {
+        display->page_mode = MUX_SHM_PAGES_TRANSPARENT;
+        display->page_size = mux_thp_size();
+        mux_printf("Framebuffer may be backed by transparent huge pages");
+    } else {
+        display->page_mode = MUX_SHM_PAGES_NORMAL;
+        display->page_size = (size_t) sysconf(_SC_PAGESIZE);
+    }
+
+    return fd;
+}
+
 /**
  * @brief Gets the socket path from the DBus service passed in.
  *
- * This function will negotiate the registration of the VM with the DBus service passed into this function.
+ * This function will negotiate the registration of the VM with the DBus service passed into this function. The memory
+ * file holding the shared framebuffer is created here and passed to the service along with the registration.
  * More information about the DBus service's archetype and such is available at some link that I haven't written yet.
  * @todo Write that stuff about DBus
  *
@@ -81,7 +206,7 @@ __PUBLIC bool mux_get_socket_path(const char *name, const char *obj, char **out_
 
             GVariant *child;
             while ((child = g_variant_iter_next_value(iter))) {
-                if (g_variant_type_equal(child, G_VARIANT_TYPE_INT32)) {
+                if (g_variant_is_of_type(child, G_VARIANT_TYPE_INT32)) {
                     if (g_variant_get_int32(child) == RDPMUX_PROTOCOL_VERSION) {
                         proto = g_variant_get_int32(child);
                         goto proto_found;
@@ -108,13 +233,44 @@ proto_found:
         return false;
     }
 
-    if (!mux_org_rdpmux_rdpmux_call_register_sync(proxy, id, RDPMUX_PROTOCOL_VERSION, display->uuid,
-                                                  port, auth, out_path, NULL, &error)) {
+    if (display->shmem_fd < 0 && (display->shmem_fd = mux_create_framebuffer_fd()) < 0)
+        return false;
+
+    // the fd list takes a copy of the fd, which is sent over the bus socket and closed along with the list.
+    GUnixFDList *fds = g_unix_fd_list_new();
+    int fd_index = g_unix_fd_list_append(fds, display->shmem_fd, &error);
+    if (fd_index < 0) {
+        mux_printf_error("could not pass framebuffer to server: %s", error->message);
+        g_error_free(error);
+        g_object_unref(fds);
+        return false;
+    }
+
+    // RegisterVM isn't in the generated connector, so call it through the underlying proxy.
+    GVariant *ret = g_dbus_proxy_call_with_unix_fd_list_sync(G_DBUS_PROXY(proxy), "RegisterVM",
+                                                             g_variant_new("(iisqsh)", id, RDPMUX_PROTOCOL_VERSION,
+                                                                           display->uuid, port, auth, fd_index),
+                                                             G_DBUS_CALL_FLAGS_NONE, -1, fds, NULL, NULL, &error);
+    g_object_unref(fds);
+    if (ret == NULL) {
         mux_printf_error("could not retrieve socket path: %s", error->message);
         g_error_free(error);
         return false;
     }
+
+    uint32_t handle = 0;
+    g_variant_get(ret, "(su)", out_path, &handle);
+    g_variant_unref(ret);
+
     assert(*out_path != NULL);
+    if (handle == 0) {
+        mux_printf_error("RDPMux server refused to register the VM");
+        g_free(*out_path);
+        *out_path = NULL;
+        return false;
+    }
+
+    display->handle = GUINT32_TO_LE(handle);
     display->vm_id = id;
     return true;
 }
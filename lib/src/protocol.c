@@ -0,0 +1,252 @@
+/** @file */
+#include <endian.h>
+
+#include "protocol.h"
+
+/**
+ * @brief Fills in a wire header.
+ *
+ * @param header The header to fill in.
+ * @param type The MessageType of the message.
+ * @param length Size in bytes of the payload following the header.
+ */
+static void mux_write_header(mux_wire_header *header, MessageType type, size_t length)
+{
+    header->type = htole32(type);
+    header->length = htole32((uint32_t) length);
+}
+
+/**
+ * @brief Decodes keyboard messages and fires the mux_receive_kb() callback with the data.
+ *
+ * @param msg The received message. Its size has already been checked by the caller.
+ */
+static void mux_process_incoming_kb_msg(const mux_wire_kb *msg)
+{
+    callbacks.mux_receive_kb(le32toh(msg->keycode), le32toh(msg->flags));
+}
+
+/**
+ * @brief Decodes mouse messages and fires the mux_receive_mouse() callback with the decoded data.
+ *
+ * @param msg The received message. Its size has already been checked by the caller.
+ */
+static void mux_process_incoming_mouse_msg(const mux_wire_mouse *msg)
+{
+    callbacks.mux_receive_mouse(le32toh(msg->x), le32toh(msg->y), le32toh(msg->flags));
+}
+
+/**
+ * @brief Decodes update completion messages and takes on the frame rate the server asks for, which
+ * mux_display_refresh() hands to the hypervisor.
+ *
+ * @param msg The received message. Its size has already been checked by the caller.
+ */
+static void mux_process_incoming_complete_msg(const mux_wire_update_ack *msg)
+{
+    uint32_t framerate = le32toh(msg->framerate);
+
+    if (le32toh(msg->success) != 1) {
+        mux_printf_error("Unsuccessful update_complete");
+        return;
+    }
+
+    if (framerate == 0) {
+        mux_printf_error("Server asked for a frame rate of 0, ignoring");
+        return;
+    }
+
+    __atomic_store_n(&display->framerate, framerate, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Checks the header of an incoming message and invokes the correct decoding function for the type of message
+ * received.
+ *
+ * Every message starts with a mux_wire_header. Messages whose length doesn't match the size of the struct for their
+ * type are dropped.
+ *
+ * @param buf The raw message data. Freed by this function.
+ * @param nbytes The size of buf.
+ */
+void mux_process_incoming_msg(void *buf, int nbytes)
+{
+    mux_wire_header *header = (mux_wire_header *) buf;
+    uint32_t msg_type, length;
+
+    if (nbytes < (int) sizeof(mux_wire_header)) {
+        mux_printf_error("Message too short");
+        goto out;
+    }
+
+    msg_type = le32toh(header->type);
+    length = le32toh(header->length);
+
+    if (length != nbytes - sizeof(mux_wire_header)) {
+        mux_printf_error("Message length %u doesn't match received size %d", length, nbytes);
+        goto out;
+    }
+
+    switch(msg_type) {
+        case MOUSE:
+            mux_printf("Processing incoming mouse msg");
+            if (nbytes == sizeof(mux_wire_mouse))
+                mux_process_incoming_mouse_msg((mux_wire_mouse *) buf);
+            break;
+        case KEYBOARD:
+            mux_printf("Processing incoming kb msg");
+            if (nbytes == sizeof(mux_wire_kb))
+                mux_process_incoming_kb_msg((mux_wire_kb *) buf);
+            break;
+        case DISPLAY_UPDATE_COMPLETE:
+            if (nbytes == sizeof(mux_wire_update_ack))
+                mux_process_incoming_complete_msg((mux_wire_update_ack *) buf);
+            break;
+        default:
+            mux_printf_error("Invalid message type");
+            break;
+    }
+
+out:
+    free(buf);
+}
+
+/**
+ * @brief Writes a display update event as a DISPLAY_UPDATE message.
+ *
+ * The payload holds x, y, w and h for each dirty rectangle in the update.
+ *
+ * @returns Size of the message in bytes.
+ *
+ * @param msg The message to write to.
+ * @param update The update to write.
+ */
+static size_t mux_write_outgoing_update_msg(mux_wire_display_update *msg, MuxUpdate *update)
+{
+    display_update *u = &update->disp_update;
+    int i;
+
+    for (i = 0; i < u->num_rects; i++) {
+        display_rect *r = &u->rects[i];
+
+        msg->rects[i].x = htole32(r->x1);
+        msg->rects[i].y = htole32(r->y1);
+        msg->rects[i].w = htole32(r->x2 - r->x1);
+        msg->rects[i].h = htole32(r->y2 - r->y1);
+    }
+
+    mux_write_header(&msg->header, DISPLAY_UPDATE, u->num_rects * sizeof(mux_wire_rect));
+    return sizeof(mux_wire_header) + u->num_rects * sizeof(mux_wire_rect);
+}
+
+/**
+ * @brief Writes a display switch event as a DISPLAY_SWITCH message.
+ *
+ * @returns Size of the message in bytes.
+ *
+ * @param msg The message to write to.
+ * @param update The update to write.
+ */
+static size_t mux_write_outgoing_switch_msg(mux_wire_display_switch *msg, MuxUpdate *update)
+{
+    display_switch *u = &update->disp_switch;
+
+    mux_write_header(&msg->header, DISPLAY_SWITCH, sizeof(*msg) - sizeof(mux_wire_header));
+    msg->format = htole32(u->format);
+    msg->w = htole32(u->w);
+    msg->h = htole32(u->h);
+
+    return sizeof(*msg);
+}
+
+/**
+ * @brief Writes an outgoing event into buf as a wire message.
+ *
+ * @returns Size of successfully written data in bytes, or 0 if the event couldn't be written.
+ *
+ * @param update The update to write. NULL writes a shutdown message.
+ * @param buf The buffer to write the message to. Should be at least MUX_MAX_MSG_SIZE bytes.
+ * @param size The size of buf in bytes.
+ */
+size_t mux_write_outgoing_msg(MuxUpdate *update, void *buf, size_t size)
+{
+    if (size < MUX_MAX_MSG_SIZE) {
+        mux_printf_error("Buffer too small to hold a message");
+        return 0;
+    }
+
+    if (update == NULL) {
+        mux_write_header((mux_wire_header *) buf, SHUTDOWN, 0);
+        return sizeof(mux_wire_header);
+    }
+
+    if (update->type == DISPLAY_UPDATE) {
+        return mux_write_outgoing_update_msg((mux_wire_display_update *) buf, update);
+    } else if (update->type == DISPLAY_SWITCH) {
+        return mux_write_outgoing_switch_msg((mux_wire_display_switch *) buf, update);
+    }
+
+    mux_printf_error("Unknown message type queued for writing!");
+    return 0;
+}
+
+/**
+ * @brief Writes a cursor shape as a CURSOR_DEFINE message.
+ *
+ * The payload holds the hotspot and size of the cursor, followed by its pixels.
+ *
+ * @returns Size of the message in bytes, or 0 if buf is too small.
+ *
+ * @param cursor The cursor shape to write.
+ * @param buf The buffer to write the message to.
+ * @param size The size of buf in bytes.
+ */
+size_t mux_write_cursor_define_msg(const mux_cursor *cursor, void *buf, size_t size)
+{
+    mux_wire_cursor_define *msg = (mux_wire_cursor_define *) buf;
+    size_t num_pixels = (size_t) cursor->width * cursor->height;
+    size_t length = 4 * sizeof(uint32_t) + num_pixels * sizeof(uint32_t);
+    size_t i;
+
+    if (size < sizeof(mux_wire_header) + length) {
+        mux_printf_error("Buffer too small to hold a cursor");
+        return 0;
+    }
+
+    mux_write_header(&msg->header, CURSOR_DEFINE, length);
+    msg->hot_x = htole32(cursor->hot_x);
+    msg->hot_y = htole32(cursor->hot_y);
+    msg->w = htole32(cursor->width);
+    msg->h = htole32(cursor->height);
+    for (i = 0; i < num_pixels; i++) {
+        msg->pixels[i] = htole32(cursor->pixels[i]);
+    }
+
+    return sizeof(mux_wire_header) + length;
+}
+
+/**
+ * @brief Writes a cursor position as a CURSOR_MOVE message.
+ *
+ * @returns Size of the message in bytes, or 0 if buf is too small.
+ *
+ * @param x X-coordinate of the cursor's hotspot in px.
+ * @param y Y-coordinate of the cursor's hotspot in px.
+ * @param buf The buffer to write the message to.
+ * @param size The size of buf in bytes.
+ */
+size_t mux_write_cursor_move_msg(int x, int y, void *buf, size_t size)
+{
+    mux_wire_cursor_move *msg = (mux_wire_cursor_move *) buf;
+
+    if (size < sizeof(*msg)) {
+        mux_printf_error("Buffer too small to hold a cursor move");
+        return 0;
+    }
+
+    mux_write_header(&msg->header, CURSOR_MOVE, sizeof(*msg) - sizeof(mux_wire_header));
+    msg->x = htole32(x);
+    msg->y = htole32(y);
+
+    return sizeof(*msg);
+}
@@ -0,0 +1,15 @@
+//
+// Created by sramanujam on 2/3/16.
+//
+
+#ifndef SHIM_PROTOCOL_H
+#define SHIM_PROTOCOL_H
+
+#include "common.h"
+
+size_t mux_write_outgoing_msg(MuxUpdate *update, void *buf, size_t size);
+size_t mux_write_cursor_define_msg(const mux_cursor *cursor, void *buf, size_t size);
+size_t mux_write_cursor_move_msg(int x, int y, void *buf, size_t size);
+void mux_process_incoming_msg(void *buf, int nbytes);
+
+#endif //SHIM_PROTOCOL_H
@@ -3,43 +3,121 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 
 #include "common.h"
-#include "msgpack.h"
+#include "protocol.h"
 #include "0mq.h"
+#include "tiles.h"
 
 InputEventCallbacks callbacks;
 MuxDisplay *display;
 
 /**
- * @func Checks whether the bounding box of the display update needs to be expanded, and does so if necessary.
+ * @func Rounds a rectangle outwards so that all of its edges lie on a 16px grid.
  *
- * This function is called when more than one display update event is received per refresh tick. It computes the smallest
- * bounding box of the display buffer that contains all the updated screen regions received thus far, and updates the
- * display update with the new coordinates.
+ * Aligning damage before it is merged keeps the rectangle list disjoint after alignment, and keeps copies in the
+ * refresh path on reasonably aligned memory.
  *
- * @param update The update object to update if necessary. Should be verified to be of type DISPLAY_UPDATE by caller.
+ * @param r The rectangle to align.
+ */
+static void mux_align_rect(display_rect *r)
+{
+    r->x1 -= (r->x1 % 16);
+    r->y1 -= (r->y1 % 16);
+
+    if (r->x2 % 16) {
+        r->x2 += 16 - (r->x2 % 16);
+    }
+
+    if (r->y2 % 16) {
+        r->y2 += 16 - (r->y2 % 16);
+    }
+}
+
+/**
+ * @func Checks whether two rectangles overlap or share an edge.
+ */
+static bool mux_rects_touch(const display_rect *a, const display_rect *b)
+{
+    return a->x1 <= b->x2 && b->x1 <= a->x2 && a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+/**
+ * @func Grows a rectangle so that it also covers another one.
+ */
+static void mux_union_rect(display_rect *dst, const display_rect *src)
+{
+    dst->x1 = MIN(dst->x1, src->x1);
+    dst->y1 = MIN(dst->y1, src->y1);
+    dst->x2 = MAX(dst->x2, src->x2);
+    dst->y2 = MAX(dst->y2, src->y2);
+}
+
+static int64_t mux_rect_area(const display_rect *r)
+{
+    return (int64_t) (r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+/**
+ * @func Adds a region to the list of dirty rectangles of a display update.
+ *
+ * This function is called when more than one display update event is received per refresh tick. Rectangles that
+ * touch the new region are folded into it, so the list stays disjoint. If the list is full, the new region is merged
+ * with whichever existing rectangle results in the smallest growth in area, and the merge is repeated until the
+ * result fits.
+ *
+ * @param u The display update to add the region to.
  * @param x The X-coordinate of the top-left corner of the new region to be included in the update.
  * @param y The Y-coordinate of the top-left corner of the new region to be included in the update.
  * @param w The width of the new region to be included in the update.
  * @param h The height of the new region to be included in the update.
  */
-static void mux_expand_rect(MuxUpdate *update, int x, int y, int w, int h)
+static void mux_add_damage(display_update *u, int x, int y, int w, int h)
 {
-    if (update->type != DISPLAY_UPDATE)
+    display_rect r = { x, y, x + w, y + h };
+    bool merged = true;
+    int i;
+
+    if (w <= 0 || h <= 0)
         return;
 
-    display_update *u = &update->disp_update;
+    mux_align_rect(&r);
+
+    while (merged) {
+        merged = false;
+
+        for (i = 0; i < u->num_rects; i++) {
+            if (mux_rects_touch(&r, &u->rects[i])) {
+                mux_union_rect(&r, &u->rects[i]);
+                u->rects[i] = u->rects[--u->num_rects];
+                merged = true;
+                break;
+            }
+        }
 
-    int new_x1 = x;
-    int new_y1 = y;
-    int new_x2 = x+w;
-    int new_y2 = y+h;
+        if (!merged && u->num_rects == MUX_MAX_DAMAGE_RECTS) {
+            int best = 0;
+            int64_t best_growth = INT64_MAX;
+
+            for (i = 0; i < u->num_rects; i++) {
+                display_rect tmp = r;
+                mux_union_rect(&tmp, &u->rects[i]);
+                int64_t growth = mux_rect_area(&tmp) - mux_rect_area(&u->rects[i]) - mux_rect_area(&r);
+                if (growth < best_growth) {
+                    best_growth = growth;
+                    best = i;
+                }
+            }
 
-    u->x1 = MIN(u->x1, new_x1);
-    u->y1 = MIN(u->y1, new_y1);
-    u->x2 = MAX(u->x2, new_x2);
-    u->y2 = MAX(u->y2, new_y2);
+            mux_union_rect(&r, &u->rects[best]);
+            u->rects[best] = u->rects[--u->num_rects];
+            merged = true;
+        }
+    }
+
+    u->rects[u->num_rects++] = r;
 }
 
 /**
@@ -91,12 +169,301 @@ static void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int y
     }
 }
 
+/**
+ * @func Sorts a list of full-width row bands by their top edge and merges the ones that overlap or touch, so that no
+ * row is copied twice.
+ *
+ * @param bands The bands to merge, in place.
+ * @param num_bands Number of entries in bands.
+ *
+ * @returns Number of bands left after merging.
+ */
+static int mux_merge_bands(display_rect *bands, int num_bands)
+{
+    int i, j;
+
+    for (i = 1; i < num_bands; i++) {
+        display_rect band = bands[i];
+
+        for (j = i; j > 0 && bands[j - 1].y1 > band.y1; j--) {
+            bands[j] = bands[j - 1];
+        }
+        bands[j] = band;
+    }
+
+    for (i = 0, j = 0; i < num_bands; i++) {
+        if (j > 0 && bands[i].y1 <= bands[j - 1].y2) {
+            bands[j - 1].y2 = MAX(bands[j - 1].y2, bands[i].y2);
+        } else {
+            bands[j++] = bands[i];
+        }
+    }
+
+    return j;
+}
+
+/**
+ * @func Gets a pointer to the pixels of a frame slot in the shared memory region.
+ */
+static unsigned char *mux_shm_slot(uint32_t slot)
+{
+    return (unsigned char *) display->shm_buffer + MUX_SHM_HEADER_SIZE + slot * display->shm_header->slot_size;
+}
+
+/**
+ * @func Gets the time from a monotonic clock, in ns.
+ */
+static uint64_t mux_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @func Measures what copying costs on this machine, so that mux_shm_publish() can tell a few long copies from many
+ * short ones apart.
+ *
+ * One large memcpy gives the cost per byte. Short copies a framebuffer row apart give the cost of starting a copy on
+ * a new row, cache and TLB misses included. Each is taken as the best of a few runs, so a preempted run doesn't skew
+ * it. This takes a few milliseconds.
+ */
+static void mux_calibrate_copy(void)
+{
+    const size_t size = 4 * 1024 * 1024;
+    const size_t stride = 4096;
+    const size_t row = 256;
+    const size_t rows = size / stride;
+    uint64_t bulk = UINT64_MAX, strided = UINT64_MAX;
+    unsigned char *src = g_malloc(size);
+    unsigned char *dst = g_malloc(size);
+    size_t off;
+    int i;
+
+    // touch every page first, so that page faults don't end up in the measurements
+    memset(src, 1, size);
+    memset(dst, 0, size);
+
+    for (i = 0; i < 3; i++) {
+        uint64_t start = mux_now_ns();
+        memcpy(dst, src, size);
+        uint64_t middle = mux_now_ns();
+        for (off = 0; off < size; off += stride)
+            memcpy(dst + off, src + off + (i + 1) % 2, row);
+        uint64_t end = mux_now_ns();
+
+        bulk = MIN(bulk, middle - start);
+        strided = MIN(strided, end - middle);
+    }
+
+    g_free(src);
+    g_free(dst);
+
+    display->copy_ns_per_byte = (double) bulk / size;
+    display->copy_ns_per_call = MAX(0.0, ((double) strided - display->copy_ns_per_byte * rows * row) / rows);
+    mux_printf("Copies cost %.3f ns per byte and %.1f ns per row", display->copy_ns_per_byte,
+               display->copy_ns_per_call);
+}
+
+/**
+ * @func Picks the cheapest way to copy a list of damaged rectangles into a frame slot.
+ *
+ * Full rows are contiguous in memory, so copying them is one memcpy no matter how many there are. Copying only the
+ * damaged columns touches fewer bytes but takes a memcpy per row. The cost of each strategy is estimated from the
+ * figures measured by mux_calibrate_copy().
+ *
+ * @param rects The damaged rectangles. May overlap.
+ * @param num_rects Number of entries in rects.
+ * @param bands Filled with the merged row bands of rects. Must have room for num_rects entries.
+ * @param num_bands Set to the number of entries in bands.
+ * @param stride Scanline of the framebuffer.
+ * @param pixel_size Bytes per pixel of the framebuffer.
+ * @param bytes Set to the number of bytes the chosen strategy copies.
+ *
+ * @returns The strategy to use.
+ */
+static mux_copy_strategy mux_pick_copy(const display_rect *rects, int num_rects, display_rect *bands, int *num_bands,
+                                       int stride, int pixel_size, uint64_t *bytes)
+{
+    uint64_t rect_bytes = 0, rect_calls = 0, band_bytes = 0;
+    int y1 = INT_MAX, y2 = 0;
+    int i;
+
+    for (i = 0; i < num_rects; i++) {
+        int line = (rects[i].x2 - rects[i].x1) * pixel_size;
+        int height = rects[i].y2 - rects[i].y1;
+
+        rect_bytes += (uint64_t) line * height;
+        rect_calls += line == stride ? 1 : height; // full-width rectangles are copied in one go
+        y1 = MIN(y1, rects[i].y1);
+        y2 = MAX(y2, rects[i].y2);
+        bands[i] = (display_rect) { 0, rects[i].y1, stride / pixel_size, rects[i].y2 };
+    }
+
+    *num_bands = mux_merge_bands(bands, num_rects);
+    for (i = 0; i < *num_bands; i++)
+        band_bytes += (uint64_t) stride * (bands[i].y2 - bands[i].y1);
+
+    uint64_t span_bytes = (uint64_t) stride * (y2 - y1);
+    double span = display->copy_ns_per_byte * span_bytes + display->copy_ns_per_call;
+    double band = display->copy_ns_per_byte * band_bytes + display->copy_ns_per_call * *num_bands;
+    double rect = display->copy_ns_per_byte * rect_bytes + display->copy_ns_per_call * rect_calls;
+
+    if (rect < band && rect < span) {
+        *bytes = rect_bytes;
+        return MUX_COPY_RECTS;
+    }
+    if (band < span) {
+        *bytes = band_bytes;
+        return MUX_COPY_BANDS;
+    }
+
+    bands[0] = (display_rect) { 0, y1, stride / pixel_size, y2 };
+    *num_bands = 1;
+    *bytes = span_bytes;
+    return MUX_COPY_SPAN;
+}
+
+/**
+ * @func Writes a new frame into the back slot of the shared memory region, then makes it the front slot.
+ *
+ * The back slot is one publish behind, so the damage written by the previous publish is copied along with the damage
+ * passed in. The slot's sequence number is odd for the duration of the copy so that a reader still looking at the
+ * slot from two publishes ago notices that it changed under it.
+ *
+ * @param rects Rectangles that changed since the last publish, clipped to the framebuffer.
+ * @param num_rects Number of entries in rects.
+ * @param src The framebuffer to copy from.
+ * @param stride Scanline of both the framebuffer and the frame slots.
+ * @param width Width of the framebuffer in px.
+ * @param bpp Bits per pixel of the framebuffer.
+ */
+static void mux_shm_publish(const display_rect *rects, int num_rects, unsigned char *src, int stride, int width,
+                            int bpp)
+{
+    mux_shm_header *header = display->shm_header;
+    display_rect all[2 * MUX_MAX_DAMAGE_RECTS];
+    display_rect bands[2 * MUX_MAX_DAMAGE_RECTS];
+    int num_all = 0, num_bands = 0;
+    uint64_t bytes = 0;
+    int i;
+
+    for (i = 0; i < num_rects; i++)
+        all[num_all++] = rects[i];
+    for (i = 0; i < display->num_prev_rects; i++)
+        all[num_all++] = display->prev_rects[i];
+
+    mux_copy_strategy strategy = mux_pick_copy(all, num_all, bands, &num_bands, stride, (bpp + 7) / 8, &bytes);
+
+    uint32_t back = (__atomic_load_n(&header->front, __ATOMIC_RELAXED) + 1) % MUX_SHM_SLOTS;
+    uint64_t seq = __atomic_load_n(&header->slot_seq[back], __ATOMIC_RELAXED);
+    unsigned char *dst = mux_shm_slot(back);
+
+    // the odd sequence number has to be visible before any of the pixels change
+    __atomic_store_n(&header->slot_seq[back], seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (strategy == MUX_COPY_RECTS) {
+        for (i = 0; i < num_all; i++) {
+            mux_copy_pixels(dst, stride, all[i].x1, all[i].y1, all[i].x2 - all[i].x1, all[i].y2 - all[i].y1,
+                            src, stride, all[i].x1, all[i].y1, bpp);
+        }
+    } else {
+        for (i = 0; i < num_bands; i++) {
+            mux_copy_pixels(dst, stride, 0, bands[i].y1, width, bands[i].y2 - bands[i].y1,
+                            src, stride, 0, bands[i].y1, bpp);
+        }
+    }
+
+    __atomic_store_n(&header->slot_seq[back], seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->front, back, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frame_seq, header->frame_seq + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&display->bytes_copied, bytes, __ATOMIC_RELAXED);
+
+    memcpy(display->prev_rects, rects, num_rects * sizeof(display_rect));
+    display->num_prev_rects = num_rects;
+}
+
+/**
+ * @func Makes sure the shared memory region has room for a framebuffer of the given size, mapping it the first time
+ * and growing it if the framebuffer doesn't fit.
+ *
+ * The region only ever grows: the server may still be reading the old layout, and growing the file keeps its mapping
+ * valid where shrinking would pull pages out from under it. The mapping a grow replaces may still hold the surface
+ * being displayed, so it is kept until the next display switch.
+ *
+ * @param stride Scanline of the framebuffer.
+ * @param height Height of the framebuffer in px.
+ *
+ * @returns Whether the region now has room for the framebuffer.
+ */
+static bool mux_shm_reserve(int stride, int height)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t slot_size = ((size_t) stride * height + page_size - 1) / page_size * page_size;
+    size_t shm_size = MUX_SHM_HEADER_SIZE + MUX_SHM_SLOTS * slot_size;
+
+    // hugetlbfs files can only be sized in whole huge pages, and a partial huge page at the end can't be a huge one.
+    shm_size = (shm_size + display->page_size - 1) / display->page_size * display->page_size;
+
+    // the memfd behind the shm region is created and handed to the server during registration.
+    if (display->shmem_fd < 0) {
+        mux_printf_error("No shared memory region, was the VM registered?");
+        return false;
+    }
+
+    if (display->shm_buffer != NULL && shm_size <= display->shm_size)
+        return true;
+
+    if (ftruncate(display->shmem_fd, shm_size)) {
+        mux_printf_error("ftruncate of buffer failed: %s", strerror(errno));
+        return false;
+    }
+
+    // mmap the shm region into our process space
+    void *shm_buffer = mmap(NULL, shm_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, display->shmem_fd, 0);
+    if (shm_buffer == MAP_FAILED) {
+        mux_printf_error("mmap failed: %s", strerror(errno));
+        return false;
+    }
+
+    // shmem only gets transparent huge pages where a mapping asks for them
+    if (display->page_mode == MUX_SHM_PAGES_TRANSPARENT && madvise(shm_buffer, shm_size, MADV_HUGEPAGE))
+        mux_printf("madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+
+    if (display->shm_buffer == NULL) {
+        mux_shm_header *header = (mux_shm_header *) shm_buffer;
+        header->num_slots = MUX_SHM_SLOTS;
+        header->page_mode = display->page_mode;
+        header->header_size = MUX_SHM_HEADER_SIZE;
+        header->slot_size = slot_size;
+        __atomic_store_n(&header->magic, MUX_SHM_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        if (display->retired_shm_buffer != NULL)
+            munmap(display->retired_shm_buffer, display->retired_shm_size);
+        display->retired_shm_buffer = display->shm_buffer;
+        display->retired_shm_size = display->shm_size;
+        // the server stops reading slots as soon as it sees slot_size change, and remaps on the DISPLAY_SWITCH.
+        __atomic_store_n(&((mux_shm_header *) shm_buffer)->slot_size, slot_size, __ATOMIC_RELEASE);
+    }
+
+    // save the pointer to the buffer for later use
+    display->shm_buffer = shm_buffer;
+    display->shm_size = shm_size;
+    display->shm_header = (mux_shm_header *) shm_buffer;
+    return true;
+}
+
 /**
  * @func Public API function designed to be called when a region of the framebuffer changes. For example, when a window
  * moves or an animation updates on screen.
  *
  * The function accepts four parameters [(x, y) w x h] that together define the rectangular bounding box of the changed
- * region in pixels.
+ * region in pixels. Regions reported between two refreshes are kept as a list of disjoint rectangles rather than
+ * merged into one bounding box, so that damage in opposite corners of the screen doesn't drag the rest of the
+ * framebuffer along with it. Only the tiles under the region that actually changed are kept, and they are kept whole,
+ * since a tile's fingerprint covers all of it.
  *
  * @param x X coordinate of the top-left corner of the changed region.
  * @param y Y-coordinate of the top-left corner of the changed region.
@@ -109,28 +476,94 @@ __PUBLIC void mux_display_update(int x, int y, int w, int h)
     MuxUpdate *update = &(display->dirty_update);
     if (update->type == MSGTYPE_INVALID) {
         update->type = DISPLAY_UPDATE;
-        update->disp_update.x1 = x;
-        update->disp_update.y1 = y;
-        update->disp_update.x2 = x+w;
-        update->disp_update.y2 = y+h;
-    } else {
-        // update dirty bounding box
-        if (update->type != DISPLAY_UPDATE) {
-            return;
+        update->disp_update.num_rects = 0;
+    } else if (update->type != DISPLAY_UPDATE) {
+        return;
+    }
+
+    if (display->surface == NULL) {
+        mux_add_damage(&update->disp_update, x, y, w, h);
+        return;
+    }
+
+    mux_tile_map *tiles = &display->tiles;
+    const unsigned char *data = (const unsigned char *) pixman_image_get_data(display->surface);
+    int stride = pixman_image_get_stride(display->surface);
+    int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(display->surface));
+    int x1 = MAX(x, 0);
+    int y1 = MAX(y, 0);
+    int x2 = MIN(x + w, tiles->width);
+    int y2 = MIN(y + h, tiles->height);
+    int col, row;
+
+    // walk the tiles under the region row by row, and add each run of changed tiles. A changed tile is added whole
+    // rather than clipped to the region: its new fingerprint covers the whole tile, so whatever changed outside the
+    // region would otherwise never be sent.
+    for (row = y1 / MUX_TILE_SIZE; y1 < y2 && row <= (y2 - 1) / MUX_TILE_SIZE; row++) {
+        int top = row * MUX_TILE_SIZE;
+        int bottom = MIN(tiles->height, top + MUX_TILE_SIZE);
+        int run_start = -1;
+
+        for (col = x1 / MUX_TILE_SIZE; x1 < x2 && col <= (x2 - 1) / MUX_TILE_SIZE; col++) {
+            bool changed = mux_tiles_changed(tiles, col, row, data, stride, bpp);
+
+            if (changed && run_start < 0)
+                run_start = col * MUX_TILE_SIZE;
+            if (!changed && run_start >= 0) {
+                mux_add_damage(&update->disp_update, run_start, top, col * MUX_TILE_SIZE - run_start, bottom - top);
+                run_start = -1;
+            }
         }
-        mux_expand_rect(update, x, y, w, h);
+
+        if (run_start >= 0)
+            mux_add_damage(&update->disp_update, run_start, top, MIN(tiles->width, col * MUX_TILE_SIZE) - run_start,
+                           bottom - top);
+    }
+
+    mux_printf("Dirty region now holds %d rectangles", update->disp_update.num_rects);
+}
+
+/**
+ * @func Public API function that creates a display surface whose pixels live in the shared memory region, so that the
+ * server reads them straight from where the hypervisor draws them.
+ *
+ * Pass the surface to mux_display_switch() to start displaying it. From then on, mux_display_refresh() only sends
+ * damage along and never copies pixels. The price is that the server may read a frame while the hypervisor is still
+ * drawing it. Don't create another surface before the switch to this one, since that may unmap it.
+ *
+ * @param format Pixel format of the surface.
+ * @param width Width of the surface in px.
+ * @param height Height of the surface in px.
+ *
+ * @returns The new surface, or NULL if the surface can't be shared, in which case the hypervisor should allocate its
+ * own and let librdpmux copy from it.
+ */
+__PUBLIC pixman_image_t *mux_display_create_surface(pixman_format_code_t format, int width, int height)
+{
+    int stride = width * ((PIXMAN_FORMAT_BPP(format) + 7) / 8);
+
+    // pixman wants rows made of whole 32-bit words, and the server expects rows without padding.
+    if (stride % sizeof(uint32_t) != 0) {
+        mux_printf("Can't share a %dx%d surface, rows would need padding", width, height);
+        return NULL;
     }
 
-    mux_printf("Bounding box updated to [(%d, %d), (%d, %d)]", update->disp_update.x1, update->disp_update.x2,
-               update->disp_update.x2, update->disp_update.y2);
+    if (!mux_shm_reserve(stride, height))
+        return NULL;
+
+    // the server keeps reading the front slot until the switch, so the new surface goes in the other one.
+    uint32_t slot = (__atomic_load_n(&display->shm_header->front, __ATOMIC_RELAXED) + 1) % MUX_SHM_SLOTS;
+
+    return pixman_image_create_bits(format, width, height, (uint32_t *) mux_shm_slot(slot), stride);
 }
 
 /**
  * @func Public API function, to be called if the framebuffer surface changes in a user-facing way; for example, when the
- * display buffer resolution changes. In here, we create a new shared memory region for the framebuffer if necessary,
- * and do a straight memcpy of the new framebuffer data into the space. We then enqueue a display switch event that
- * contains the new shm region's information and the new dimensions of the display buffer. Finally, we notify the outside
- * about the new target framerate we'd like
+ * display buffer resolution changes. In here, we create a shared memory region sized to fit the framebuffer if
+ * necessary, grow it if the new framebuffer doesn't fit, and publish the new framebuffer data into it, unless the
+ * surface already lives there. We then enqueue a display switch event that contains the new shm region's information
+ * and the new dimensions of the display buffer. Finally, we notify the outside about the new target framerate we'd
+ * like
  *
  * @param surface The new framebuffer display surface.
  *
@@ -146,46 +579,42 @@ __PUBLIC void mux_display_switch(pixman_image_t *surface)
     int width = pixman_image_get_width(display->surface);
     int height = pixman_image_get_height(display->surface);
 
-    // do all sorts of stuff to get the shmem region opened and ready
-    const char *socket_fmt = "/%d.rdpmux";
-    char socket_str[20] = ""; // 20 is a magic number carefully chosen
-                              // to be the length of INT_MAX plus the characters
-                              // in socket_fmt. If you change socket_fmt, make
-                              // sure to change this too.
-    int shm_size = 4096 * 2048 * sizeof(uint32_t); // rdp protocol has max framebuffer size 4096x2048
-    sprintf(socket_str, socket_fmt, display->vm_id);
+    int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(display->surface));
+    int stride = width * ((bpp + 7) / 8);
+    uint32_t slot;
 
-    // set up the shm region. This path only runs the first time a display switch event is received.
-    if (display->shmem_fd < 0) {
-        // this is the shm buffer being created! Hooray!
-        int shim_fd = shm_open(socket_str,
-                               O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IRGRP | S_IROTH);
-        if (shim_fd < 0) {
-            mux_printf_error("shm_open failed: %s", strerror(errno));
-            return;
-        }
+    if (!mux_shm_reserve(stride, height))
+        return;
 
-        // resize the newly created shm region to the size of the framebuffer
-        if (ftruncate(shim_fd, shm_size)) {
-            mux_printf_error("ftruncate of new buffer failed: %s", strerror(errno));
-            return;
-        }
-        // save our new shm file descriptor for later use
-        display->shmem_fd = shim_fd;
-
-        // mmap the shm region into our process space
-        void *shm_buffer = mmap(NULL, shm_size, PROT_READ | PROT_WRITE,
-                                MAP_SHARED, display->shmem_fd, 0);
-        if (shm_buffer == MAP_FAILED) {
-            mux_printf_error("mmap failed: %s", strerror(errno));
-            return;
-        }
+    // the whole surface is published below, so whatever the tiles held before doesn't matter anymore
+    mux_tiles_reset(&display->tiles, width, height);
 
-        // save the pointer to the buffer for later use
-        display->shm_buffer = shm_buffer;
+    for (slot = 0; slot < MUX_SHM_SLOTS; slot++) {
+        if ((unsigned char *) framebuf_data == mux_shm_slot(slot))
+            break;
+    }
+    display->direct = slot < MUX_SHM_SLOTS;
+
+    if (display->direct) {
+        // the surface came from mux_display_create_surface(), so its pixels are already where the server reads them.
+        // All that's left is pointing the server at them.
+        __atomic_store_n(&display->shm_header->front, slot, __ATOMIC_RELEASE);
+        __atomic_store_n(&display->shm_header->frame_seq, display->shm_header->frame_seq + 1, __ATOMIC_RELEASE);
+        display->num_prev_rects = 0;
+    } else {
+        // publish the whole new framebuffer. Marking it as the previous damage too makes the next publish bring the
+        // other slot up to date.
+        display_rect full = { 0, 0, width, height };
+        display->num_prev_rects = 0;
+        mux_shm_publish(&full, 1, (unsigned char *) framebuf_data, stride, width, bpp);
+    }
+
+    // the old surface is gone now, so the mapping it may have lived in can go too
+    if (display->retired_shm_buffer != NULL) {
+        munmap(display->retired_shm_buffer, display->retired_shm_size);
+        display->retired_shm_buffer = NULL;
     }
 
-    memcpy(display->shm_buffer, framebuf_data, width * height * sizeof(uint32_t));
     // create the event update
 
     MuxUpdate *update = &display->out_update;
@@ -214,71 +643,58 @@ __PUBLIC void mux_display_switch(pixman_image_t *surface)
 /**
  * @func Public API function, to be called when the framebuffer display refreshes.
  *
- * This function attempts to lock the shared memory region, and if it succeeds, will sync the framebuffer
- * to the shared memory and copy the current dirty update for transmission.
+ * This function attempts to lock the shared memory region, and if it succeeds, will publish the damaged parts of the
+ * framebuffer as a new frame in the shared memory and copy the current dirty update for transmission.
+ *
+ * @returns The frame rate the server would like the hypervisor to refresh at. The server lowers it while nobody is
+ * watching or the clients can't keep up, and raises it again once they can.
  */
 __PUBLIC uint32_t mux_display_refresh()
 {
     if (display->dirty_update.type == DISPLAY_UPDATE) {
+        int i;
         int pixelSize;
-        size_t x = 0;
-        size_t y = 0;
-        size_t w = 0;
-        size_t h = 0;
         display_update *u = &(display->dirty_update.disp_update);
-        size_t surfaceWidth = pixman_image_get_width(display->surface);
-        size_t surfaceHeight = pixman_image_get_height(display->surface);
+        int surfaceWidth = pixman_image_get_width(display->surface);
+        int surfaceHeight = pixman_image_get_height(display->surface);
         int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(display->surface));
         unsigned char *srcData = (unsigned char *) pixman_image_get_data(display->surface);
-        unsigned char *dstData = (unsigned char *) display->shm_buffer;
 
-        // align the bounding box to 16 for memory alignment purposes
-        if (u->x1 % 16) {
-            u->x1 -= (u->x1 % 16);
-        }
-
-        if (u->y1 % 16) {
-            u->y1 -= (u->y1 % 16);
-        }
-
-        if (u->x2 % 16) {
-            u->x2 += 16 - (u->x2 % 16);
-        }
-
-        if (u->y2 % 16) {
-            u->y2 += 16 - (u->y2 % 16);
-        }
+        pixelSize = (bpp + 7) / 8;
 
-        if (u->x2 > surfaceWidth) {
-            u->x2 = surfaceWidth;
+        // clip the dirty rectangles to the surface, dropping any that end up empty
+        for (i = 0; i < u->num_rects; ) {
+            display_rect *r = &u->rects[i];
+            r->x1 = MAX(r->x1, 0);
+            r->y1 = MAX(r->y1, 0);
+            r->x2 = MIN(r->x2, surfaceWidth);
+            r->y2 = MIN(r->y2, surfaceHeight);
+
+            if (r->x1 >= r->x2 || r->y1 >= r->y2) {
+                *r = u->rects[--u->num_rects];
+                continue;
+            }
+            i++;
         }
 
-        if (u->y2 > surfaceHeight) {
-            u->y2 = surfaceHeight;
+        if (u->num_rects == 0) {
+            display->dirty_update.type = MSGTYPE_INVALID;
+            return __atomic_load_n(&display->framerate, __ATOMIC_RELAXED);
         }
 
-        y = u->y1;
-        h = u->y2 - u->y1;
-
-        pixelSize = (bpp + 7) / 8;
-
-        // aligning the copy offsets does not yield a good performance gain,
-        // but copying contiguous memory blocks makes a huge difference.
-        // by forcing copying of full lines on buffers with the same step,
-        // we can use a single memcpy rather than one memcpy per line.
-        // this may over-copy a bit sometimes, but it's still way cheaper.
-        x = 0;
-        w = surfaceWidth;
-
-        mux_expand_rect(&display->dirty_update, u->x1, u->y1, u->x2 - u->x1, u->y2 - u->y1);
-
         if (pthread_mutex_trylock(&display->out_lock) == 0) {
             //////////////////////////////////////////////////////////////////////
             /////////////////////////////////////////////////////////////////////
             //                     CRITICAL SECTION                            //
             ////////////////////////////////////////////////////////////////////
             ////////////////////////////////////////////////////////////////////
-            mux_copy_pixels(dstData, w * pixelSize, x, y, w, h, srcData, w * pixelSize, x, y, bpp);
+            if (display->direct) {
+                // the hypervisor drew straight into the shared memory, so there is nothing to copy.
+                __atomic_store_n(&display->shm_header->frame_seq, display->shm_header->frame_seq + 1,
+                                 __ATOMIC_RELEASE);
+            } else {
+                mux_shm_publish(u->rects, u->num_rects, srcData, surfaceWidth * pixelSize, surfaceWidth, bpp);
+            }
 
             if (display->out_ready == false &&
                 display->out_update.type == MSGTYPE_INVALID) { // we don't have another event queued
@@ -297,7 +713,93 @@ __PUBLIC uint32_t mux_display_refresh()
         mux_printf("Refresh deferred");
     }
 
-    return (uint32_t) 30;
+    return __atomic_load_n(&display->framerate, __ATOMIC_RELAXED);
+}
+
+/**
+ * @func Public API function, to be called when the hypervisor's cursor changes shape. The shape is shown by the RDP
+ * clients themselves on top of the framebuffer, so hypervisors using it should leave the cursor out of the
+ * framebuffer; moving it with mux_cursor_move() then costs no damage at all. To hide the cursor, define one whose
+ * pixels are all transparent.
+ *
+ * Only the latest shape is sent, so defining several shapes in quick succession only sends the last one.
+ *
+ * @param hot_x X-coordinate of the cursor's hotspot, relative to its top left corner.
+ * @param hot_y Y-coordinate of the cursor's hotspot, relative to its top left corner.
+ * @param width Width of the cursor in px, at most MUX_MAX_CURSOR_SIZE.
+ * @param height Height of the cursor in px, at most MUX_MAX_CURSOR_SIZE.
+ * @param pixels The cursor's pixels, row by row without padding, as a8r8g8b8 with straight alpha.
+ *
+ * @returns Whether the shape was taken. Shapes that are empty or too big are not.
+ */
+__PUBLIC bool mux_cursor_define(int hot_x, int hot_y, int width, int height, const uint32_t *pixels)
+{
+    if (width < 1 || height < 1 || width > MUX_MAX_CURSOR_SIZE || height > MUX_MAX_CURSOR_SIZE || pixels == NULL) {
+        mux_printf_error("Can't define a %dx%d cursor", width, height);
+        return false;
+    }
+
+    pthread_mutex_lock(&display->out_lock);
+    display->cursor.hot_x = MIN(MAX(hot_x, 0), width - 1);
+    display->cursor.hot_y = MIN(MAX(hot_y, 0), height - 1);
+    display->cursor.width = width;
+    display->cursor.height = height;
+    memcpy(display->cursor.pixels, pixels, (size_t) width * height * sizeof(uint32_t));
+    display->cursor_defined = true;
+    pthread_mutex_unlock(&display->out_lock);
+
+    return true;
+}
+
+/**
+ * @func Public API function, to be called when the hypervisor's cursor moves. Nothing about the framebuffer changes,
+ * so nothing is copied or encoded; the RDP clients just move their cursor.
+ *
+ * Only the latest position is sent, so a burst of moves between two passes of the main loop costs one message.
+ *
+ * @param x X-coordinate of the cursor's hotspot in px.
+ * @param y Y-coordinate of the cursor's hotspot in px.
+ */
+__PUBLIC void mux_cursor_move(int x, int y)
+{
+    pthread_mutex_lock(&display->out_lock);
+    display->cursor_x = MAX(x, 0);
+    display->cursor_y = MAX(y, 0);
+    display->cursor_moved = true;
+    pthread_mutex_unlock(&display->out_lock);
+}
+
+/**
+ * @func Sends the cursor's shape and position to the server if they changed since they were last sent, the shape
+ * first so that the clients move the right cursor.
+ *
+ * @param buf Buffer to write the messages to. Should be at least MUX_MAX_MSG_SIZE bytes.
+ * @param size The size of buf in bytes.
+ */
+static void mux_send_cursor(uint8_t *buf, size_t size)
+{
+    size_t len = 0;
+
+    pthread_mutex_lock(&display->out_lock);
+    if (display->cursor_defined) {
+        len = mux_write_cursor_define_msg(&display->cursor, buf, size);
+        display->cursor_defined = false;
+    }
+    pthread_mutex_unlock(&display->out_lock);
+
+    while (len > 0 && mux_0mq_send_msg(buf, len) < 0)
+        mux_printf_error("Failed to send cursor shape");
+
+    len = 0;
+    pthread_mutex_lock(&display->out_lock);
+    if (display->cursor_moved) {
+        len = mux_write_cursor_move_msg(display->cursor_x, display->cursor_y, buf, size);
+        display->cursor_moved = false;
+    }
+    pthread_mutex_unlock(&display->out_lock);
+
+    while (len > 0 && mux_0mq_send_msg(buf, len) < 0)
+        mux_printf_error("Failed to send cursor position");
 }
 
 /*
@@ -325,13 +827,11 @@ __PUBLIC void *mux_display_buffer_update_loop(void *arg)
 
 static void mux_send_shutdown_msg()
 {
-    nnStr msg;
-    msg.buf = NULL;
-    size_t len = mux_write_outgoing_msg(NULL, &msg); // NULL means shutdown!
-    while(mux_0mq_send_msg(msg.buf, len) < 0) {
+    uint8_t msg[MUX_MAX_MSG_SIZE];
+    size_t len = mux_write_outgoing_msg(NULL, msg, sizeof(msg)); // NULL means shutdown!
+    while(mux_0mq_send_msg(msg, len) < 0) {
         mux_printf_error("Failed to send shutdown message!");
     }
-    g_free(msg.buf);
     mux_printf("Shutdown message sent!");
 }
 
@@ -352,9 +852,8 @@ __PUBLIC void *mux_mainloop(void *arg)
 
     // main shim receive loop
     int nbytes;
+    uint8_t msg[MUX_MAX_MSG_SIZE];
     while(!stopping) {
-        nnStr msg;
-        msg.buf = NULL;
         buf = NULL;
         MuxUpdate out;
         bool ready = false;
@@ -381,15 +880,16 @@ __PUBLIC void *mux_mainloop(void *arg)
 
         if (ready) {
             if (out.type != MSGTYPE_INVALID) {
-                len = mux_write_outgoing_msg(&out, &msg);
-                while (mux_0mq_send_msg(msg.buf, len) < 0)
+                len = mux_write_outgoing_msg(&out, msg, sizeof(msg));
+                while (len > 0 && mux_0mq_send_msg(msg, len) < 0)
                     mux_printf_error("Failed to send message");
 
-                g_free(msg.buf);
                 memset(&out, 0, sizeof(MuxUpdate));
             }
         }
 
+        mux_send_cursor(msg, sizeof(msg));
+
         // block on receiving messages
         zsock_t *which = (zsock_t *) zpoller_wait(poller, 5); // 5ms timeout
         if (which != display->zmq.socket)  {
@@ -423,7 +923,7 @@ __PUBLIC void *mux_mainloop(void *arg)
  * struct initialized, which is defined as an opaque type in the public header so that client code can't mess with it.
  *
  * You must pass a string containing an UUID into the VM. This UUID will be used to uniquely identify the VM with the
- * frontend server, and will be passed in every message.
+ * frontend server during registration. Messages themselves carry the compact handle the server hands back.
  *
  * @param uuid A UUID describing the VM.
  */
@@ -434,6 +934,7 @@ __PUBLIC MuxDisplay *mux_init_display_struct(const char *uuid)
     display->uuid = NULL;
     display->zmq.socket = NULL;
     display->framerate = 30;
+    mux_calibrate_copy();
 
     if (uuid != NULL) {
         if (strlen(uuid) != 36) {
@@ -464,6 +965,29 @@ __PUBLIC void mux_register_event_callbacks(InputEventCallbacks cb)
     callbacks = cb;
 }
 
+/**
+ * @func Asks for the shared framebuffer to be backed by huge pages, which cuts down on TLB misses while the server and
+ * librdpmux copy frames in and out of it. Must be called between mux_init_display_struct() and mux_get_socket_path().
+ *
+ * hugetlbfs pages are tried first, then transparent huge pages if the kernel allows them for shmem. If neither is
+ * available, normal pages are used as before. The server reports which of them each VM got.
+ *
+ * @param enable Whether to try huge pages.
+ */
+__PUBLIC void mux_set_huge_pages(bool enable)
+{
+    display->huge_pages = enable;
+}
+
+/**
+ * @func Gets the number of bytes librdpmux has copied into the shared framebuffer so far. Surfaces created with
+ * mux_display_create_surface() are never copied, so they don't add to it.
+ */
+__PUBLIC uint64_t mux_get_bytes_copied(void)
+{
+    return __atomic_load_n(&display->bytes_copied, __ATOMIC_RELAXED);
+}
+
 /**
  * @func Should be called to safely cleanup library state. Note that ZeroMQ threads may (will) hang around forever
  * unless they're cleaned up by this method.
@@ -0,0 +1,131 @@
+/** @file */
+#include "tiles.h"
+
+/**
+ * @brief Odd 64-bit constants the hash multiplies by, the ones xxHash64 uses.
+ */
+#define MUX_HASH_PRIME1 0x9e3779b185ebca87ULL
+#define MUX_HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+
+/**
+ * @func Scrambles the bits of a 64-bit value, so that every input bit affects every output bit.
+ */
+static uint64_t mux_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * @func Folds one 64-bit word into a hash lane, the way xxHash64 does.
+ *
+ * A multiply only carries changes upward, so on its own it would leave a change to a word's top bit in the lane's
+ * top bit, where a second such change cancels it out. The rotation brings the top bits back down before the next
+ * multiply spreads them.
+ */
+static inline uint64_t mux_hash_round(uint64_t lane, uint64_t w)
+{
+    lane += w * MUX_HASH_PRIME2;
+    lane = (lane << 31) | (lane >> 33);
+    return lane * MUX_HASH_PRIME1;
+}
+
+/**
+ * @func Hashes the pixels of a rectangle of the framebuffer.
+ *
+ * Rows are consumed as 64-bit words spread over four independent lanes, so the multiplies don't wait on each other
+ * and the compiler is free to vectorize the loop.
+ *
+ * @param data Pointer to the first pixel of the rectangle.
+ * @param stride Scanline of the framebuffer.
+ * @param row_bytes Width of the rectangle in bytes.
+ * @param height Height of the rectangle in px.
+ *
+ * @returns The hash, never 0.
+ */
+static uint64_t mux_hash_rect(const unsigned char *data, int stride, size_t row_bytes, int height)
+{
+    uint64_t lanes[4] = { 1, 2, 3, 4 };
+    uint64_t h;
+    int y, i;
+
+    for (y = 0; y < height; y++) {
+        const unsigned char *p = data + (size_t) y * stride;
+        size_t n = 0;
+
+        for (; n + 4 * sizeof(uint64_t) <= row_bytes; n += 4 * sizeof(uint64_t)) {
+            for (i = 0; i < 4; i++) {
+                uint64_t w;
+                memcpy(&w, p + n + i * sizeof(uint64_t), sizeof(w));
+                lanes[i] = mux_hash_round(lanes[i], w);
+            }
+        }
+
+        for (i = 0; n < row_bytes; n += sizeof(uint64_t), i++) {
+            uint64_t w = 0;
+            memcpy(&w, p + n, MIN(sizeof(w), row_bytes - n));
+            lanes[i % 4] = mux_hash_round(lanes[i % 4], w);
+        }
+    }
+
+    h = mux_hash_mix(lanes[0]) ^ mux_hash_mix(lanes[1] + 1) ^ mux_hash_mix(lanes[2] + 2) ^ mux_hash_mix(lanes[3] + 3);
+    return h ? h : 1;
+}
+
+/**
+ * @func Sets up a tile map for a framebuffer of a new size. Every tile starts out unknown, so the first time each one
+ * is checked it counts as changed.
+ *
+ * @param map The tile map to set up.
+ * @param width Width of the framebuffer in px.
+ * @param height Height of the framebuffer in px.
+ */
+void mux_tiles_reset(mux_tile_map *map, int width, int height)
+{
+    int cols = (width + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE;
+    int rows = (height + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE;
+
+    if (cols * rows != map->cols * map->rows) {
+        g_free(map->hashes);
+        map->hashes = g_new(uint64_t, cols * rows);
+    }
+
+    memset(map->hashes, 0, cols * rows * sizeof(uint64_t));
+    map->width = width;
+    map->height = height;
+    map->cols = cols;
+    map->rows = rows;
+}
+
+/**
+ * @func Checks whether a tile's pixels changed since the last time it was checked.
+ *
+ * @param map The tile map of the framebuffer.
+ * @param col Column of the tile.
+ * @param row Row of the tile.
+ * @param data Pointer to the framebuffer.
+ * @param stride Scanline of the framebuffer.
+ * @param bpp Bits per pixel of the framebuffer.
+ *
+ * @returns Whether the tile changed. Unknown tiles always count as changed.
+ */
+bool mux_tiles_changed(mux_tile_map *map, int col, int row, const unsigned char *data, int stride, int bpp)
+{
+    int x = col * MUX_TILE_SIZE;
+    int y = row * MUX_TILE_SIZE;
+    int w = MIN(MUX_TILE_SIZE, map->width - x);
+    int h = MIN(MUX_TILE_SIZE, map->height - y);
+    size_t pixel_size = (bpp + 7) / 8;
+    uint64_t *stored = &map->hashes[row * map->cols + col];
+    uint64_t hash = mux_hash_rect(data + (size_t) y * stride + x * pixel_size, stride, w * pixel_size, h);
+
+    if (hash == *stored)
+        return false;
+
+    *stored = hash;
+    return true;
+}
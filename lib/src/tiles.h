@@ -0,0 +1,16 @@
+/** @file */
+
+#ifndef SHIM_TILES_H
+#define SHIM_TILES_H
+
+#include "common.h"
+
+/**
+ * @brief Width and height in px of a tile.
+ */
+#define MUX_TILE_SIZE 64
+
+void mux_tiles_reset(mux_tile_map *map, int width, int height);
+bool mux_tiles_changed(mux_tile_map *map, int col, int row, const unsigned char *data, int stride, int bpp);
+
+#endif //SHIM_TILES_H
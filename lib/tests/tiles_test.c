@@ -0,0 +1,63 @@
+/** @file */
+/*
+ * Checks that changing a tile's pixels changes its fingerprint, for changes that cancelled out in earlier versions
+ * of the hash: two flips of the top bit of a 64-bit word that land in the same hash lane.
+ */
+#include "tiles.h"
+
+/**
+ * @func Fingerprints a zeroed 64x64 tile, flips the top bit of the given bytes, and checks that the tile counts as
+ * changed.
+ *
+ * @returns 1 if the change went unnoticed, 0 otherwise.
+ */
+static int check_flips(const char *name, int bpp, const int *offsets, int num_offsets)
+{
+    int stride = MUX_TILE_SIZE * bpp / 8;
+    unsigned char *data = g_malloc0(stride * MUX_TILE_SIZE);
+    mux_tile_map map = { 0 };
+    int failed = 0;
+    int i;
+
+    mux_tiles_reset(&map, MUX_TILE_SIZE, MUX_TILE_SIZE);
+    mux_tiles_changed(&map, 0, 0, data, stride, bpp);
+    if (mux_tiles_changed(&map, 0, 0, data, stride, bpp)) {
+        fprintf(stderr, "FAIL: %s: unchanged tile counts as changed\n", name);
+        failed = 1;
+    }
+
+    for (i = 0; i < num_offsets; i++)
+        data[offsets[i]] ^= 0x80;
+
+    if (!mux_tiles_changed(&map, 0, 0, data, stride, bpp)) {
+        fprintf(stderr, "FAIL: %s: change went unnoticed\n", name);
+        failed = 1;
+    }
+
+    g_free(map.hashes);
+    g_free(data);
+    return failed;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    // the top red bit of r5g6b5 pixels 3 and 19 in the first row: bit 63 of words 0 and 4, both in lane 0
+    const int r5g6b5_same_row[] = { 7, 39 };
+    // the top red bit of r5g6b5 pixel 3 in the first two rows
+    const int r5g6b5_two_rows[] = { 7, MUX_TILE_SIZE * 2 + 7 };
+    // bytes 7 and 39 of the first row of an r8g8b8 tile
+    const int r8g8b8_same_row[] = { 7, 39 };
+
+    failures += check_flips("r5g6b5, two pixels in a row", 16, r5g6b5_same_row, 2);
+    failures += check_flips("r5g6b5, one pixel in two rows", 16, r5g6b5_two_rows, 2);
+    failures += check_flips("r8g8b8, two bytes in a row", 24, r8g8b8_same_row, 2);
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("All tile changes noticed\n");
+    return 0;
+}
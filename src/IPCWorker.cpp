@@ -0,0 +1,361 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <msgpack/pack.hpp>
+#include <sys/eventfd.h>
+#include "IPCWorker.h"
+#include "util/MessageDecoder.h"
+
+IPCWorker::IPCWorker(zmq::context_t &context, std::string path, ListenerTable &table)
+        : path(path),
+          stop(false),
+          wake_fd(-1),
+          waiting(false),
+          reported_drops(0),
+          listeners(table),
+          zsocket(context, ZMQ_ROUTER)
+{
+    zsocket.setsockopt(ZMQ_ROUTER_MANDATORY, 1);
+    zsocket.bind(path);
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        throw std::runtime_error(std::string("eventfd() failed: ") + strerror(errno));
+    }
+}
+
+IPCWorker::~IPCWorker()
+{
+    stop = true;
+    wake();
+
+    if (loop_thread.joinable())
+        loop_thread.join();
+
+    close(wake_fd);
+}
+
+void IPCWorker::Start()
+{
+    loop_thread = std::thread(&IPCWorker::run, this);
+}
+
+std::string IPCWorker::SocketPath()
+{
+    return path;
+}
+
+void IPCWorker::wake()
+{
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG(WARNING) << "Could not wake IPCWorker loop: " << strerror(errno);
+    }
+}
+
+void IPCWorker::AddListener(std::string uuid, uint32_t handle)
+{
+    std::lock_guard<std::mutex> lock(listener_lock);
+    uuid_handles[uuid] = handle;
+}
+
+void IPCWorker::RemoveListener(std::string uuid)
+{
+    std::lock_guard<std::mutex> lock(listener_lock);
+    uuid_handles.erase(uuid);
+}
+
+namespace {
+    uint32_t read_le32(const void *buf)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(buf);
+        return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+               static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+    }
+
+    /**
+     * @brief Whether the message is a mouse event that only moves the cursor.
+     */
+    bool is_motion(const QueueItem &item)
+    {
+        return item.length == 4 && item.data[0] == MOUSE && item.data[3] == PTR_FLAGS_MOVE;
+    }
+}
+
+void IPCWorker::sendMessage(const QueueItem &item, uint64_t coalesced)
+{
+    zmq::multipart_t msg;
+    std::shared_ptr<RDPListener> listener = listeners.Find(item.handle);
+    uint16_t slot = HandleSlot(item.handle);
+
+    if (!listener) {
+        LOG(WARNING) << "Dropping message for unknown VM handle " << item.handle;
+        return;
+    }
+
+    if (slot >= routes.size() || routes[slot].handle != item.handle) {
+        LOG(ERROR) << "Could not find connection id for UUID " << listener->UUID();
+        return;
+    }
+
+    Route &route = routes[slot];
+    msg.addstr(route.id);
+    if (route.by_handle) {
+        uint8_t handle[sizeof(uint32_t)] = {
+                static_cast<uint8_t>(item.handle), static_cast<uint8_t>(item.handle >> 8),
+                static_cast<uint8_t>(item.handle >> 16), static_cast<uint8_t>(item.handle >> 24)
+        };
+        msg.addmem(handle, sizeof(handle));
+    } else {
+        msg.addstr(listener->UUID());
+    }
+
+    if (listener->ProtocolVersion() == RDPMUX_PROTOCOL_VERSION_MSGPACK) {
+        pack_buf.clear();
+        msgpack::packer<msgpack::sbuffer> packer(pack_buf);
+        packer.pack_array(item.length);
+        for (uint32_t i = 0; i < item.length; i++) {
+            packer.pack_uint32(item.data[i]);
+        }
+        msg.addmem(pack_buf.data(), pack_buf.size());
+    } else {
+        uint8_t buf[RDPMUX_WIRE_HEADER_SIZE + RDPMUX_MAX_OUTGOING_LENGTH * sizeof(uint32_t)];
+        size_t len = EncodeWireMessage(item.data, item.length, buf, sizeof(buf));
+        if (len == 0) {
+            LOG(ERROR) << "Unable to encode message of type " << item.data[0];
+            return;
+        }
+        msg.addmem(buf, len);
+    }
+
+    if (!msg.send(zsocket) || !msg.empty()) {
+        LOG(ERROR) << "Unable to send message of type " << item.data[0];
+        return;
+    }
+
+    if (item.data[0] == MOUSE)
+        listener->CountMouseEvents(1, coalesced);
+}
+
+void IPCWorker::dispatchMessage(const QueueItem &item, uint64_t coalesced)
+{
+    try {
+        sendMessage(item, coalesced);
+    } catch (zmq::error_t &ex) {
+        // nothing will wake us up for the rest of the queue, so drop this message and carry on
+        LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+    }
+}
+
+void IPCWorker::coalesceMotion(const QueueItem &item)
+{
+    for (auto &pending : pending_motion) {
+        if (pending.item.handle == item.handle) {
+            pending.item = item;
+            pending.coalesced++;
+            return;
+        }
+    }
+
+    pending_motion.push_back({item, 0});
+}
+
+void IPCWorker::flushMotion(uint32_t handle)
+{
+    if (handle == 0) {
+        for (auto &pending : pending_motion) {
+            dispatchMessage(pending.item, pending.coalesced);
+        }
+        pending_motion.clear();
+        return;
+    }
+
+    for (auto it = pending_motion.begin(); it != pending_motion.end(); ++it) {
+        if (it->item.handle == handle) {
+            PendingMotion pending = *it;
+            pending_motion.erase(it);
+            dispatchMessage(pending.item, pending.coalesced);
+            return;
+        }
+    }
+}
+
+void IPCWorker::queueOutgoingMessage(const QueueItem &item)
+{
+    if (!out_queue.enqueue(item))
+        return; // counted by the queue, and logged by the worker thread
+
+    // make sure the item is visible before checking whether the worker went to sleep without it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.exchange(false))
+        wake();
+}
+
+void IPCWorker::run()
+{
+    int ret = -1;
+    zmq::pollitem_t items[] = {
+            {(void *) zsocket, 0, ZMQ_POLLIN, 0},
+            {nullptr, wake_fd, ZMQ_POLLIN, 0}
+    };
+    zmq::pollitem_t &item = items[0];
+
+    while (true) {
+        // check if we are terminating
+        if (stop) {
+            LOG(INFO) << "IPCWorker " << path << " terminating on stop";
+            return;
+        }
+
+        // send outgoing messages first, merging runs of cursor motion so the VM only sees the latest position
+        QueueItem msg;
+        while (out_queue.tryDequeue(msg)) {
+            if (is_motion(msg)) {
+                coalesceMotion(msg);
+                continue;
+            }
+
+            flushMotion(msg.handle);
+            dispatchMessage(msg);
+        }
+        flushMotion(0);
+
+        uint64_t drops = out_queue.Dropped();
+        if (drops != reported_drops) {
+            LOG(WARNING) << "IPCWorker " << path << " dropped " << drops - reported_drops
+                         << " outgoing messages on a full queue (" << out_queue.Enqueued() << " queued so far)";
+            reported_drops = drops;
+        }
+
+        // announce that we're about to sleep, then look at the queue once more so that an item queued after the
+        // drain above but before the announcement still gets sent without waiting for the next wakeup.
+        long timeout = -1;
+        waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!out_queue.isEmpty()) {
+            waiting.store(false);
+            timeout = 0;
+        }
+
+        // block until the VM sends us something or there's something to send to it
+        try {
+            ret = zmq::poll(items, 2, timeout);
+        } catch (zmq::error_t &ex) {
+            LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+            continue;
+        }
+        waiting.store(false);
+
+        if (items[1].revents & ZMQ_POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                LOG(WARNING) << "Could not reset IPCWorker wakeup: " << strerror(errno);
+            }
+        }
+
+        if (ret > 0) {
+
+            if (item.revents & ZMQ_POLLIN) {
+                receiveMessage();
+            }
+        } else if (ret == -1) {
+            LOG(WARNING) << "Error polling socket: " << ret;
+        }
+    }
+}
+
+void IPCWorker::receiveMessage()
+{
+    zmq::message_t *frames[] = {&id_frame, &addr_frame, &data_frame};
+    zmq::message_t extra_frame;
+    size_t parts = 0;
+    bool more = true;
+
+    // pull in every part of the message, keeping the first three
+    while (more) {
+        zmq::message_t &frame = parts < 3 ? *frames[parts] : extra_frame;
+        if (!zsocket.recv(&frame, ZMQ_DONTWAIT))
+            return;
+        parts++;
+        more = frame.more();
+    }
+
+    if (parts != 3) {
+        LOG(WARNING) << "Possibly invalid message received! Message has " << parts << " parts";
+        return;
+    }
+
+    // v6 VMs that registered through RegisterVM address us by their 4-byte handle, everything else by UUID.
+    uint32_t handle = 0;
+    bool by_handle = addr_frame.size() == sizeof(uint32_t);
+
+    if (by_handle) {
+        handle = read_le32(addr_frame.data());
+    } else if (addr_frame.size() == RDPMUX_UUID_LENGTH) {
+        // uuid_buf keeps its capacity between messages, so this doesn't allocate
+        uuid_buf.assign(static_cast<const char *>(addr_frame.data()), addr_frame.size());
+
+        std::lock_guard<std::mutex> lock(listener_lock);
+        auto it = uuid_handles.find(uuid_buf);
+        if (it != uuid_handles.end())
+            handle = it->second;
+    } else {
+        LOG(WARNING) << "Invalid VM address frame of " << addr_frame.size() << " bytes received";
+        return;
+    }
+
+    std::shared_ptr<RDPListener> server = listeners.Find(handle);
+    if (!server) {
+        LOG(WARNING) << "Listener for VM handle " << handle << " does not exist in table!";
+        return;
+    }
+
+    // the connection id only changes when the VM reconnects, so only write it when it's actually different.
+    uint16_t slot = HandleSlot(handle);
+    if (routes.size() <= slot)
+        routes.resize(slot + 1);
+
+    Route &route = routes[slot];
+    const char *id = static_cast<const char *>(id_frame.data());
+    if (route.handle != handle || route.by_handle != by_handle ||
+        route.id.compare(0, std::string::npos, id, id_frame.size()) != 0) {
+        route.handle = handle;
+        route.by_handle = by_handle;
+        route.id.assign(id, id_frame.size());
+    }
+
+    // cursor shapes carry their pixels, which don't fit in a VMMessage, so they get decoded on their own
+    if (server->ProtocolVersion() != RDPMUX_PROTOCOL_VERSION_MSGPACK &&
+        data_frame.size() >= RDPMUX_WIRE_HEADER_SIZE && read_le32(data_frame.data()) == CURSOR_DEFINE) {
+        if (!DecodeCursorDefine(data_frame.data(), data_frame.size(), cursor_buf)) {
+            LOG(ERROR) << "Malformed cursor shape received from VM " << server->UUID();
+            return;
+        }
+        server->processCursorDefine(cursor_buf);
+        return;
+    }
+
+    VMMessage msg;
+    bool decoded = server->ProtocolVersion() == RDPMUX_PROTOCOL_VERSION_MSGPACK
+                   ? DecodeMessage(data_frame.data(), data_frame.size(), msg)
+                   : DecodeWireMessage(data_frame.data(), data_frame.size(), msg);
+    if (!decoded) {
+        LOG(ERROR) << "Malformed message received from VM " << server->UUID();
+        return;
+    }
+
+    server->processIncomingMessage(msg);
+}
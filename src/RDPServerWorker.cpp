@@ -14,26 +14,45 @@
  * limitations under the License.
  */
 
-#include <msgpack/object.hpp>
-#include <msgpack/unpack.hpp>
 #include "RDPServerWorker.h"
-
-RDPServerWorker::RDPServerWorker(uint16_t port, bool auth)
-        : starting_port(3901),
-          initialized(false),
-          context(1), // todo: explore the possibility of needing more than one thread
-          zsocket(context, ZMQ_ROUTER),
-          authenticating(auth)
+#include <fcntl.h>
+
+RDPServerWorker::RDPServerWorker(uint16_t first_port, uint16_t last_port, bool auth, unsigned int num_workers,
+                                 unsigned int copy_threads)
+        : initialized(false),
+          port_pool(first_port, last_port),
+          context(std::max(num_workers, 1u)),
+          authenticating(auth),
+          copy_pool(std::make_shared<ThreadPool>(copy_threads))
 {
-    std::string path = "ipc://@/tmp/rdpmux";
-    zsocket.setsockopt(ZMQ_ROUTER_MANDATORY, 1);
-    zsocket.bind(path);
+    for (unsigned int i = 0; i < std::max(num_workers, 1u); i++) {
+        // the first worker keeps the historical path, so a single-worker daemon looks exactly like it used to
+        std::string path = "ipc://@/tmp/rdpmux";
+        if (i > 0)
+            path += "-" + std::to_string(i);
+        workers.push_back(make_unique<IPCWorker>(context, path, listeners));
+    }
 }
 
 RDPServerWorker::~RDPServerWorker()
 {
-    std::lock_guard<std::mutex> lock(stop_mutex);
-    stop = true;
+    // workers have to stop before the context and the listeners they reference go away
+    workers.clear();
+}
+
+std::shared_ptr<ThreadPool> RDPServerWorker::CopyPool()
+{
+    return copy_pool;
+}
+
+IPCWorker *RDPServerWorker::workerFor(uint32_t handle)
+{
+    return workers[HandleSlot(handle) % workers.size()].get();
+}
+
+std::string RDPServerWorker::SocketPath(uint32_t handle)
+{
+    return workerFor(handle)->SocketPath();
 }
 
 void RDPServerWorker::setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn)
@@ -47,184 +66,107 @@ void RDPServerWorker::setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn
 
 bool RDPServerWorker::Initialize()
 {
-    std::thread loop(&RDPServerWorker::run, this);
-    loop.detach();
+    for (auto &worker : workers) {
+        worker->Start();
+    }
     initialized = true;
     return initialized;
 }
 
-bool RDPServerWorker::RegisterNewVM(std::string uuid, int id, std::string auth, uint16_t port = 0)
+uint32_t RDPServerWorker::RegisterNewVM(std::string uuid, int id, std::string auth, uint16_t port, int version,
+                                        int shm_fd)
 {
-    std::lock_guard<std::mutex> lock(container_lock); // take lock on both ports and listener_map
-    uint16_t used_port = 0;
+    uint16_t used_port = port;
     std::shared_ptr<RDPListener> l;
 
-    if (port == 0) {
-        // find the next available port
-        // if this gets slow for you, consider not running as many VMs on the same computer
-        for (uint16_t i = starting_port; i < 65535; i++) {
-            if (ports.count(i) == 0) {
-                // check if port is available to be bound
-                struct addrinfo hints, *res;
-                int sockfd;
-
-                memset(&hints, 0, sizeof(hints));
-                hints.ai_family = AF_INET; // IPv4
-                hints.ai_socktype = SOCK_STREAM; // TCP stream socket
-                getaddrinfo("0.0.0.0", std::to_string(i).c_str(), &hints,
-                            &res); // check for usage across all interfaces
-
-                sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-                // try binding
-                int ret = bind(sockfd, res->ai_addr, res->ai_addrlen);
-                free(res); // free the linked list of results no matter what
-                if (ret < 0) { // failed, continue the loop
-                    continue;
-                }
-                // cleanup and setting the port if we suceeded
-                close(sockfd);
-                used_port = i;
-                break;
-            }
+    // the framebuffer is mapped for as long as the VM lives, so a VM that could shrink the file would be able to
+    // fault us at will.
+    int seals = shm_fd >= 0 ? fcntl(shm_fd, F_GET_SEALS) : 0;
+    if (shm_fd >= 0 && (seals < 0 || !(seals & F_SEAL_SHRINK))) {
+        LOG(WARNING) << "Framebuffer passed by VM " << uuid << " is not sealed against shrinking";
+        close(shm_fd);
+        return 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(container_lock);
+        if (listener_map.find(uuid) != listener_map.end()) {
+            LOG(WARNING) << "VM " << uuid << " is already registered";
+            if (shm_fd >= 0)
+                close(shm_fd);
+            return 0;
         }
-    } else {
-        used_port = port;
     }
 
-    if (used_port == 0 || used_port > 65535) {
-        LOG(WARNING) << "Invalid server port number: " << used_port;
-        return false;
+    // ports are handed out before taking container_lock, so a slow bind check doesn't hold up other registrations
+    if (port == 0) {
+        used_port = port_pool.Acquire();
+        if (used_port == 0) {
+            LOG(WARNING) << "No free listener ports left";
+            if (shm_fd >= 0)
+                close(shm_fd);
+            return 0;
+        }
+    } else if (!port_pool.Reserve(port)) {
+        LOG(WARNING) << "Requested listener port " << port << " is already in use";
+        if (shm_fd >= 0)
+            close(shm_fd);
+        return 0;
     }
 
-    ports.insert(used_port);
+    std::lock_guard<std::mutex> lock(container_lock); // take lock on listener_map
+
+    // the same VM may have registered again while we were picking a port
+    if (listener_map.find(uuid) != listener_map.end()) {
+        LOG(WARNING) << "VM " << uuid << " is already registered";
+        port_pool.Release(used_port);
+        if (shm_fd >= 0)
+            close(shm_fd);
+        return 0;
+    }
 
     try {
-        l = std::make_shared<RDPListener>(uuid, id, used_port, this, auth, dbus_conn);
+        l = std::make_shared<RDPListener>(uuid, id, used_port, this, auth, dbus_conn, version, shm_fd);
     } catch (std::exception &e) {
-        return false;
+        port_pool.Release(used_port);
+        if (shm_fd >= 0)
+            close(shm_fd);
+        return 0;
+    }
+
+    uint32_t handle = listeners.Insert(l);
+    if (handle == 0) {
+        LOG(WARNING) << "No free VM handles left";
+        port_pool.Release(used_port);
+        return 0;
     }
+    l->Handle(handle);
 
     std::thread l_thread([l]() {l->RunServer();}); // i think this properly increments and decrements...?
     l_thread.detach();
 
     listener_map.insert(std::make_pair(uuid, l));
+    workerFor(handle)->AddListener(uuid, handle);
 
-    return true;
+    return handle;
 }
 
-void RDPServerWorker::UnregisterVM(std::string uuid, uint16_t port)
+void RDPServerWorker::UnregisterVM(std::string uuid)
 {
     std::lock_guard<std::mutex> lock(container_lock);
-    ports.erase(port);
-    listener_map.erase(uuid); // rip server
-}
-
-void RDPServerWorker::sendMessage(std::vector<uint16_t> vec, std::string uuid)
-{
-    zmq::multipart_t msg;
 
-    try {
-        msg.addstr(connection_map.at(uuid));
-    } catch (std::out_of_range &e) {
-        LOG(ERROR) << "Could not find connection id for UUID " << uuid;
-        return;
-    }
-
-    msg.addstr(uuid);
-
-    msgpack::sbuffer sbuf;
-    msgpack::pack(&sbuf, vec);
-
-    msg.addmem(sbuf.data(), sbuf.size());
-
-    if (!msg.send(zsocket) || !msg.empty()) {
-        LOG(ERROR) << "Unable to send message " << vec;
+    auto it = listener_map.find(uuid);
+    if (it != listener_map.end()) {
+        uint32_t handle = it->second->Handle();
+        workerFor(handle)->RemoveListener(uuid);
+        listeners.Remove(handle);
+        // only the listener knows which port it holds, so a stray call can't free a port somebody else is using
+        port_pool.Release(it->second->Port());
+        listener_map.erase(it); // rip server
     }
 }
 
-void RDPServerWorker::queueOutgoingMessage(QueueItem item)
+void RDPServerWorker::queueOutgoingMessage(const QueueItem &item)
 {
-    out_queue.enqueue(std::move(item));
-}
-
-void RDPServerWorker::run()
-{
-    int ret = -1;
-    zmq::pollitem_t item = {
-            (void *) zsocket,
-            0,
-            ZMQ_POLLIN,
-            0
-    };
-
-    while (true) {
-        // check if we are terminating
-        std::lock_guard<std::mutex> lock(stop_mutex);
-        if (stop) {
-            LOG(INFO) << "ServerWorker loop terminating on stop";
-            initialized = false;
-            return;
-        }
-
-        // send outgoing messages first
-        while (!out_queue.isEmpty()) {
-            QueueItem msg = out_queue.dequeue();
-            auto vec = std::get<0>(msg);
-            try {
-                sendMessage(vec, std::get<1>(msg));
-            } catch (zmq::error_t &ex) {
-                LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
-                break;
-            }
-        }
-
-        try {
-            ret = zmq::poll(&item, 1, 5); // todo : determine reasonable poll interval
-        } catch (zmq::error_t &ex) {
-            LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
-            continue;
-        }
-
-        if (ret > 0) {
-
-            if (item.revents & ZMQ_POLLIN) {
-                zmq::multipart_t multi(zsocket);
-
-                if (multi.size() != 3) {
-                    LOG(WARNING) << "Possibly invalid message received! Message is: " << multi.str();
-                    continue;
-                }
-
-                //VLOG(3) << multi.str();
-
-                std::string id = multi.popstr();
-                std::string uuid = multi.popstr();
-                std::string data = multi.popstr();
-
-                msgpack::unpacked unpacked;
-                msgpack::unpack(&unpacked, data.data(), data.size());
-
-                // deserialize msgpack message and pass to correct server
-                try {
-                    // so these two lines have to be in this order. if listener_map.at() fails, it'll skip the
-                    // connection_map line, which will silently create and/or update if nothing exists.
-                    auto server = listener_map.at(uuid);
-                    connection_map[uuid] = id;
-
-                    msgpack::object obj = unpacked.get();
-                    std::vector<uint32_t> vec;
-                    obj.convert(&vec);
-                    server->processIncomingMessage(vec);
-                } catch (std::out_of_range &e) {
-                    LOG(WARNING) << "Listener with UUID " << uuid << " does not exist in map!";
-                } catch (std::exception &e) {
-                    LOG(ERROR) << "Msgpack conversion failed: " << e.what();
-                    LOG(ERROR) << "Offending buffer is " << unpacked.get();
-                }
-            }
-        } else if (ret == -1) {
-            LOG(WARNING) << "Error polling socket: " << ret;
-        }
-    }
+    workerFor(item.handle)->queueOutgoingMessage(item);
 }
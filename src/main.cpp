@@ -15,6 +15,10 @@
  */
 
 #include "common.h"
+#include <algorithm>
+#include <giomm/unixfdlist.h>
+#include <thread>
+#include <unistd.h>
 #include <boost/program_options.hpp>
 #include "RDPServerWorker.h"
 
@@ -39,6 +43,16 @@ namespace {
             "      <arg type='s' name='authFile' direction='in' />"
             "      <arg type='s' name='socket_path' direction='out'/>"
             "    </method>"
+            "    <method name='RegisterVM'>"
+            "      <arg type='i' name='id' direction='in'/>"
+            "      <arg type='i' name='version' direction='in' />"
+            "      <arg type='s' name='uuid' direction='in' />"
+            "      <arg type='q' name='port' direction='in' />"
+            "      <arg type='s' name='authFile' direction='in' />"
+            "      <arg type='h' name='framebuffer' direction='in' />"
+            "      <arg type='s' name='socket_path' direction='out'/>"
+            "      <arg type='u' name='handle' direction='out'/>"
+            "    </method>"
             "    <property type='ai' name='SupportedProtocolVersions' access='read' />"
             "  </interface>"
             "</node>";
@@ -69,7 +83,18 @@ static void on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& conn,
         const Glib::VariantContainerBase& parameters,
         const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation)
 {
-    if (method_name == "Register") {
+    if (method_name == "Register" || method_name == "RegisterVM") {
+        // RegisterVM also hands back the VM's handle, which it can use in place of its UUID on the socket.
+        const bool with_handle = (method_name == "RegisterVM");
+        auto reply = [&invocation, with_handle](Glib::ustring path, uint32_t handle) {
+            std::vector<Glib::VariantBase> values;
+            values.push_back(Glib::Variant<Glib::ustring>::create(path));
+            if (with_handle)
+                values.push_back(Glib::Variant<uint32_t>::create(handle));
+            invocation->return_value(Glib::VariantContainerBase::create_tuple(values));
+        };
+
+
         Glib::Variant<int> id_variant;
         Glib::Variant<int> ver_variant;
         Glib::Variant<std::string> uuid_variant;
@@ -87,31 +112,40 @@ static void on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& conn,
         uint16_t port = port_variant.get();
         std::string auth = auth_variant.get();
 
-        if (ver != RDPMUX_PROTOCOL_VERSION) {
-            invocation->return_value(
-                    Glib::VariantContainerBase::create_tuple(
-                            Glib::Variant<Glib::ustring>::create("")
-                    )
-            );
+        // RegisterVM also passes the memory file holding the framebuffer. Register VMs share it by name instead.
+        int shm_fd = -1;
+        if (with_handle) {
+            Glib::VariantBase fd_variant;
+            parameters.get_child(fd_variant, 5);
+            auto fds = invocation->get_message()->get_unix_fd_list();
+            try {
+                if (fds)
+                    shm_fd = fds->get(g_variant_get_handle(fd_variant.gobj()));
+            } catch (Glib::Error &e) {
+                LOG(WARNING) << "Could not receive framebuffer from VM: " << e.what();
+            }
+            if (shm_fd < 0) {
+                reply("", 0);
+                return;
+            }
+        }
+
+        if (ver != RDPMUX_PROTOCOL_VERSION && ver != RDPMUX_PROTOCOL_VERSION_MSGPACK) {
+            reply("", 0);
             LOG(INFO) << "Client tried to connect using unsupported protocol version, ignoring";
+            if (shm_fd >= 0)
+                close(shm_fd);
             return;
         }
 
-        if (!broker->RegisterNewVM(uuid, vm_id, auth, port)) {
+        uint32_t handle = broker->RegisterNewVM(uuid, vm_id, auth, port, ver, shm_fd);
+        if (handle == 0) {
             LOG(WARNING) << "VM Registration failed!";
-            invocation->return_value(
-                    Glib::VariantContainerBase::create_tuple(
-                            Glib::Variant<Glib::ustring>::create("")
-                    )
-            );
+            reply("", 0);
             return;
         }
 
-        Glib::ustring g_res = "ipc://@/tmp/rdpmux";
-        const auto response_variant = Glib::Variant<Glib::ustring>::create(g_res);
-        Glib::VariantContainerBase response = Glib::VariantContainerBase::create_tuple(response_variant);
-
-        invocation->return_value(response);
+        reply(broker->SocketPath(handle), handle);
     }
 }
 
@@ -124,9 +158,10 @@ static void on_property_call(Glib::VariantBase& property,
         const Glib::ustring& property_name)
 {
     if (property_name == "SupportedProtocolVersions") {
-        // pretty inextensible way to do this, but since we have no other versions, it'll suffice for now.
+        // newest first, so clients that take the first version they understand get the binary protocol.
         auto versions = std::vector<int>();
         versions.push_back(RDPMUX_PROTOCOL_VERSION);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_MSGPACK);
         auto ver_var = Glib::Variant<std::vector<int>>::create(versions);
         property = ver_var;
     }
@@ -187,15 +222,42 @@ void process_options(const int argc, const char *argv[])
                         po::value<uint16_t>()->default_value(3901),
                         "Port to begin spawning listeners on."
                 )
+                (
+                        "last-port,l",
+                        po::value<uint16_t>()->default_value(65534),
+                        "Last port listeners may be spawned on."
+                )
                 (
                         "no-auth,n",
                         po::bool_switch()->default_value(false),
                         "Disable authentication for peer connections"
                 )
+                (
+                        "borrow-framebuffer",
+                        po::bool_switch()->default_value(false),
+                        "Let the RDP encoders read VM framebuffers straight from shared memory when their format allows it, "
+                        "instead of from a copy. Saves a copy per frame, but frames may be encoded while the VM draws them."
+                )
+                (
+                        "max-fps",
+                        po::value<unsigned int>()->default_value(RDPMUX_MAX_FRAMERATE),
+                        "Highest frame rate VMs are asked to draw at, and frames are taken from them at."
+                )
                 (
                         "config-path,c",
                         po::value<std::string>()->default_value("/etc/rdpmux"),
                         "Configuration directory path"
+                )
+                (
+                        "ipc-threads,t",
+                        po::value<unsigned int>()->default_value(1),
+                        "Number of threads servicing VM communication. VMs are spread across them evenly."
+                )
+                (
+                        "copy-threads",
+                        po::value<unsigned int>(),
+                        "Number of threads helping copy large frames out of VM framebuffers, shared by all VMs. "
+                        "Defaults to one less than the number of CPUs."
                 );
         po::basic_parsed_options<char> parsed = parser.options(desc).allow_unregistered().run();
         po::store(parsed, vm);
@@ -236,21 +298,33 @@ int main(int argc, const char* argv[])
     }
 
     auto port = vm["port"].as<uint16_t>();
+    auto last_port = vm["last-port"].as<uint16_t>();
     bool auth = !vm["no-auth"].as<bool>(); // take the opposite of no-auth to determine whether to auth connections
+    auto ipc_threads = vm["ipc-threads"].as<unsigned int>();
+
+    // the capture thread doing the copy takes a share of it too
+    unsigned int copy_threads = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+    if (vm.count("copy-threads"))
+        copy_threads = vm["copy-threads"].as<unsigned int>();
+
+    if (ipc_threads < 1) {
+        LOG(FATAL) << "At least one IPC thread is required";
+        return 1;
+    }
 
     // final check to make sure starting port is within bounds
-    if (port > 0 && port < 65535) {
+    if (port > 0 && port < 65535 && last_port >= port) {
         if (port < 1024) {
             LOG(WARNING) << "Port number is low (below 1024), may conflict with other system services!";
         }
         try {
-            broker = make_unique<RDPServerWorker>(port, auth); // create broker
+            broker = make_unique<RDPServerWorker>(port, last_port, auth, ipc_threads, copy_threads); // create broker
         } catch (std::exception &e) {
             LOG(FATAL) << "Error initializing socket: " << e.what();
             return 1;
         }
     } else {
-        LOG(FATAL) << "Invalid port number " << port;
+        LOG(FATAL) << "Invalid port range " << port << "-" << last_port;
         return 1;
     }
 
@@ -16,9 +16,11 @@
 
 #include "rdp/RDPListener.h"
 #include "RDPServerWorker.h"
+#include <algorithm>
 #include <fcntl.h>
 #include <msgpack/object.hpp>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "rdp/subsystem.h"
 #include <boost/program_options.hpp>
 
@@ -38,21 +40,60 @@ Glib::ustring RDPListener::introspection_xml =
         "    <property type='i' name='Port' access='read' />"
         "    <property type='i' name='NumConnectedPeers' access='read'/>"
         "    <property type='b' name='RequiresAuthentication' access='read'/>"
+        "    <property type='t' name='MouseEventsForwarded' access='read'/>"
+        "    <property type='t' name='MouseEventsCoalesced' access='read'/>"
+        "    <property type='t' name='EstimatedEncodes' access='read'/>"
+        "    <property type='t' name='EstimatedEncodesIfGrouped' access='read'/>"
+        "    <property type='u' name='EstimatedPeerGroups' access='read'/>"
+        "    <property type='s' name='FramebufferPages' access='read'/>"
+        "    <property type='u' name='MaxFrameRate' access='readwrite'/>"
+        "    <property type='u' name='MinFrameRate' access='readwrite'/>"
+        "    <property type='s' name='Profile' access='readwrite'/>"
         "  </interface>"
         "</node>";
 
 RDPListener::RDPListener(std::string uuid, int vm_id, uint16_t port, RDPServerWorker *parent, std::string auth,
-                         Glib::RefPtr<Gio::DBus::Connection> conn) : shm_buffer(nullptr),
+                         Glib::RefPtr<Gio::DBus::Connection> conn, int version, int shm_fd) : shm_buffer(nullptr),
+                                                                     shm_header(nullptr),
                                                                      dbus_conn(conn),
                                                                      parent(parent),
                                                                      port(port),
                                                                      uuid(uuid),
                                                                      samfile(),
                                                                      vm_id(vm_id),
+                                                                     protocol_version(version),
+                                                                     handle(0),
+                                                                     shm_fd(shm_fd),
+                                                                     shm_size(0),
+                                                                     shm_header_size(0),
+                                                                     shm_slot_size(0),
+                                                                     shm_stale(false),
+                                                                     shm_page_mode(RDPMUX_SHM_PAGES_NORMAL),
                                                                      listener_running(false),
-                                                                     targetFPS(30),
-                                                                     credential_path()
+                                                                     max_fps(RDPMUX_MAX_FRAMERATE),
+                                                                     min_fps(RDPMUX_IDLE_FRAMERATE),
+                                                                     profile(FrameProfile::Latency),
+                                                                     credential_path(),
+                                                                     mouse_forwarded(0),
+                                                                     mouse_coalesced(0),
+                                                                     estimated_encodes(0),
+                                                                     estimated_encodes_if_grouped(0),
+                                                                     estimated_peer_groups(0),
+                                                                     cursor_defined(false),
+                                                                     cursor_shape_changed(false),
+                                                                     cursor_x(0),
+                                                                     cursor_y(0),
+                                                                     cursor_positioned(false),
+                                                                     cursor_moved(false)
 {
+    width = height = pending_width = pending_height = 0;
+    format = pending_format = static_cast<pixman_format_code_t>(0);
+    shm_fits = false;
+    region16_init(&dirty_region);
+    damage_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    cursor_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    copy_pool = parent->CopyPool();
+    max_fps = std::min(std::max(vm["max-fps"].as<unsigned int>(), 1u), RDPMUX_FRAMERATE_LIMIT);
     WTSRegisterWtsApiFunctionTable(FreeRDP_InitWtsApi());
 
     shadow_subsystem_set_entry(RDPMux_ShadowSubsystemEntry);
@@ -73,12 +114,20 @@ RDPListener::~RDPListener()
         std::lock_guard<std::mutex> lock(listenerStopMutex);
         if (listener_running) {
             listener_running = false;
+            SetEvent(damage_event);
             usleep(200000);
         }
     }
     shadow_server_uninit(server);
     shadow_server_free(server);
     dbus_conn->unregister_object(registered_id);
+    region16_uninit(&dirty_region);
+    CloseHandle(damage_event);
+    CloseHandle(cursor_event);
+    if (shm_buffer)
+        munmap(shm_buffer, shm_size);
+    if (shm_fd >= 0)
+        close(shm_fd);
     WSACleanup();
 }
 
@@ -94,7 +143,8 @@ void RDPListener::RunServer()
     // dbus setup
     Glib::RefPtr<Gio::DBus::NodeInfo> introspection_data;
     const Gio::DBus::InterfaceVTable vtable(sigc::mem_fun(this, &RDPListener::on_method_call),
-                                            sigc::mem_fun(this, &RDPListener::on_property_call));
+                                            sigc::mem_fun(this, &RDPListener::on_property_call),
+                                            sigc::mem_fun(this, &RDPListener::on_set_property));
     // create server name
     Glib::ustring dbus_name = "/org/RDPMux/RDPListener/";
     // sanitize uuid before creating dbus object
@@ -151,59 +201,353 @@ cleanup:
 
 void RDPListener::shutdown()
 {
-    parent->UnregisterVM(this->uuid, this->port);
+    parent->UnregisterVM(this->uuid);
 }
 
 
-void RDPListener::processOutgoingMessage(std::vector<uint16_t> vec)
+void RDPListener::processOutgoingMessage(std::initializer_list<uint32_t> values)
 {
-    QueueItem item = std::make_tuple(vec, this->uuid);
+    QueueItem item;
+
+    if (values.size() > RDPMUX_MAX_OUTGOING_LENGTH) {
+        LOG(ERROR) << "LISTENER " << this << ": Outgoing message has too many values, dropping";
+        return;
+    }
+
+    item.length = 0;
+    for (uint32_t value : values) {
+        item.data[item.length++] = value;
+    }
+    item.handle = handle;
+
     parent->queueOutgoingMessage(item);
 }
 
-void RDPListener::processIncomingMessage(std::vector<uint32_t> rvec)
+void RDPListener::processIncomingMessage(const VMMessage &msg)
 {
     // we filter by what type of message it is
-    if (rvec[0] == DISPLAY_UPDATE) {
-        processDisplayUpdate(rvec);
-    } else if (rvec[0] == DISPLAY_SWITCH) {
+    if (msg.data[0] == DISPLAY_UPDATE) {
+        processDisplayUpdate(msg);
+    } else if (msg.data[0] == DISPLAY_SWITCH) {
         VLOG(2) << "LISTENER " << this << ": processing display switch event now";
-        processDisplaySwitch(rvec);
-    } else if (rvec[0] == SHUTDOWN) {
+        processDisplaySwitch(msg);
+    } else if (msg.data[0] == CURSOR_MOVE && msg.length == 3) {
+        processCursorMove(msg);
+    } else if (msg.data[0] == SHUTDOWN) {
         VLOG(2) << "LISTENER " << this << ": Shutdown event received!";
         {
             std::lock_guard<std::mutex> lock(listenerStopMutex);
             listener_running = false;
         }
+        SetEvent(damage_event);
     } else {
         // what the hell have you sent me
         LOG(WARNING) << "Invalid message type sent.";
     }
 }
 
-std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> RDPListener::GetDirtyRegion()
+bool RDPListener::MapFramebuffer()
+{
+    if (!shm_stale.load(std::memory_order_acquire))
+        return shm_fits;
+
+    size_t new_width, new_height;
+    pixman_format_code_t new_format;
+    {
+        std::lock_guard<std::mutex> lock(switchMutex);
+        new_width = pending_width;
+        new_height = pending_height;
+        new_format = pending_format;
+        shm_stale.store(false, std::memory_order_relaxed);
+    }
+
+    // frames drawn after the switch don't have the old geometry anymore, so nothing is read until there is a mapping
+    // that holds one of the new geometry. If there isn't one, the VM's next display switch is the next chance.
+    shm_fits = false;
+
+    int bpp = std::get<2>(rdpFormat(new_format));
+    if (bpp < 0) {
+        LOG(WARNING) << "LISTENER " << this << ": Unsupported framebuffer format " << new_format;
+        return false;
+    }
+    size_t frame_size = new_width * new_height * bpp;
+
+    if (!mapFramebufferRegion(frame_size))
+        return false;
+
+    width = new_width;
+    height = new_height;
+    format = new_format;
+    shm_fits = true;
+    return true;
+}
+
+bool RDPListener::mapFramebufferRegion(size_t frame_size)
+{
+    if (shm_fd >= 0)
+        return mapRegion(shm_fd, frame_size);
+
+    // VMs that predate passing the framebuffer at registration still share it under a name derived from their ID.
+    std::stringstream ss;
+    ss << "/" << vm_id << ".rdpmux";
+
+    VLOG(2) << "LISTENER " << this << ": Mapping shmem buffer from path " << ss.str();
+    int shim_fd = shm_open(ss.str().data(), O_RDONLY, S_IRUSR | S_IRGRP | S_IROTH);
+    if (shim_fd < 0) {
+        LOG(WARNING) << "LISTENER " << this << ": shm_open() failed: " << strerror(errno);
+        return false;
+    }
+
+    bool mapped = mapRegion(shim_fd, frame_size);
+    close(shim_fd);
+    return mapped;
+}
+
+bool RDPListener::mapRegion(int fd, size_t frame_size)
+{
+    bool layered = protocol_version >= RDPMUX_PROTOCOL_VERSION;
+
+    // the VM sizes the region to fit its framebuffer, so take the size from the region itself.
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOG(WARNING) << "LISTENER " << this << ": fstat() failed: " << strerror(errno);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+
+    if (shm_buffer && size == shm_size) {
+        // the region hasn't grown, so the layout is the same and the current mapping is as good as a new one.
+        if (frame_size > shm_slot_size) {
+            LOG(WARNING) << "LISTENER " << this << ": Shared memory region is too small for a " << frame_size
+                         << " byte framebuffer";
+            return false;
+        }
+        return true;
+    }
+
+    // read-only even while surfaces borrow frame slots from it, see rdpmux_subsystem_borrow_slot()
+    void *buffer = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (buffer == MAP_FAILED) {
+        LOG(WARNING) << "LISTENER " << this << ": mmap() failed: " << strerror(errno);
+        // todo: send this information to the backend service so it can trigger a retry
+        return false;
+    }
+
+    ShmHeader *header = nullptr;
+    uint64_t header_size = 0;
+    uint64_t capacity = size;
+    if (layered) {
+        header = static_cast<ShmHeader *>(buffer);
+        if (size < sizeof(ShmHeader) || __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != RDPMUX_SHM_MAGIC) {
+            LOG(WARNING) << "LISTENER " << this << ": Shared memory region has an invalid header";
+            munmap(buffer, size);
+            return false;
+        }
+
+        // the VM can write to the header at any time, so the layout is read once and only the copies are used
+        // from here on. The slot check is a division so that a huge slot size can't wrap around.
+        uint32_t num_slots = __atomic_load_n(&header->num_slots, __ATOMIC_RELAXED);
+        header_size = __atomic_load_n(&header->header_size, __ATOMIC_RELAXED);
+        capacity = __atomic_load_n(&header->slot_size, __ATOMIC_RELAXED);
+        if (num_slots != RDPMUX_SHM_SLOTS || header_size < sizeof(ShmHeader) || header_size > size ||
+            capacity > (size - header_size) / RDPMUX_SHM_SLOTS) {
+            LOG(WARNING) << "LISTENER " << this << ": Shared memory region has an invalid header";
+            munmap(buffer, size);
+            return false;
+        }
+    }
+
+    if (frame_size > capacity) {
+        LOG(WARNING) << "LISTENER " << this << ": Shared memory region is too small for a " << frame_size
+                     << " byte framebuffer";
+        munmap(buffer, size);
+        return false;
+    }
+
+    uint32_t page_mode = header ? __atomic_load_n(&header->page_mode, __ATOMIC_RELAXED) : RDPMUX_SHM_PAGES_NORMAL;
+    // shmem is only mapped with transparent huge pages where the mapping asks for them, same as on the VM's side
+    if (page_mode == RDPMUX_SHM_PAGES_TRANSPARENT && madvise(buffer, size, MADV_HUGEPAGE) < 0)
+        VLOG(2) << "LISTENER " << this << ": madvise(MADV_HUGEPAGE) failed: " << strerror(errno);
+    shm_page_mode.store(page_mode, std::memory_order_relaxed);
+
+    if (shm_buffer)
+        munmap(shm_buffer, shm_size);
+
+    shm_buffer = buffer;
+    shm_header = header;
+    shm_size = size;
+    shm_header_size = header_size;
+    shm_slot_size = capacity;
+
+    VLOG(2) << "LISTENER " << this << ": mmap() of " << size << " bytes completed successfully! Page mode: "
+            << page_mode;
+    return true;
+}
+
+const BYTE *RDPListener::BeginFrameRead(uint32_t &slot, uint64_t &seq)
+{
+    if (!shm_header) {
+        slot = 0;
+        seq = 0;
+        return static_cast<const BYTE *>(shm_buffer);
+    }
+
+    // front may flip between reading it and reading the slot's sequence number. The slot we landed on can only be
+    // mid-write if the VM published twice in between, so this settles almost immediately. The retries are bounded
+    // in case the VM died halfway through a write; EndFrameRead() rejects an odd sequence number.
+    for (int i = 0; i < 64; i++) {
+        slot = __atomic_load_n(&shm_header->front, __ATOMIC_ACQUIRE) % RDPMUX_SHM_SLOTS;
+        seq = __atomic_load_n(&shm_header->slot_seq[slot], __ATOMIC_ACQUIRE);
+        if (!(seq & 1))
+            break;
+    }
+
+    // the VM grew the region and the new slots are beyond our mapping. The display switch it sent along with it
+    // makes MapFramebuffer() catch up.
+    if (__atomic_load_n(&shm_header->slot_size, __ATOMIC_ACQUIRE) != shm_slot_size)
+        return nullptr;
+
+    return static_cast<const BYTE *>(shm_buffer) + shm_header_size + slot * shm_slot_size;
+}
+
+bool RDPListener::EndFrameRead(uint32_t slot, uint64_t seq)
+{
+    if (!shm_header)
+        return true;
+
+    if (seq & 1)
+        return false;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shm_header->slot_seq[slot], __ATOMIC_RELAXED) == seq;
+}
+
+void RDPListener::RestoreDirtyRegion(const REGION16 *region)
+{
+    std::lock_guard<std::mutex> lock(dimMutex);
+    UINT32 numRects = 0;
+    const RECTANGLE_16 *rects = region16_rects(region, &numRects);
+
+    for (UINT32 i = 0; i < numRects; i++) {
+        region16_union_rect(&dirty_region, &dirty_region, &rects[i]);
+    }
+    SetEvent(damage_event);
+}
+
+void RDPListener::DrainDirtyRegion(REGION16 *region)
 {
     std::lock_guard<std::mutex> lock(dimMutex);
-    return std::make_tuple(x, y, w, h);
+    UINT32 numRects = 0;
+    const RECTANGLE_16 *rects = region16_rects(&dirty_region, &numRects);
+
+    for (UINT32 i = 0; i < numRects; i++) {
+        region16_union_rect(region, region, &rects[i]);
+    }
+    region16_clear(&dirty_region);
 }
 
-void RDPListener::processDisplayUpdate(std::vector<uint32_t> msg)
+void RDPListener::processDisplayUpdate(const VMMessage &msg)
 {
-    // note that under current calling conditions, this will run in the mainloop of the RDPServerWorker.
+    // note that under current calling conditions, this will run in the mainloop of the IPCWorker.
 
     VLOG(3) << "LISTENER " << this << ": Now processing display update message";
+    size_t numRects = (msg.length - 1) / 4;
+
+    std::lock_guard<std::mutex> lock(dimMutex);
+
+    for (size_t i = 0; i < numRects; i++) {
+        uint32_t x = msg.data[1 + 4 * i];
+        uint32_t y = msg.data[2 + 4 * i];
+        uint32_t w = msg.data[3 + 4 * i];
+        uint32_t h = msg.data[4 + 4 * i];
+        RECTANGLE_16 rect;
+
+        rect.left = static_cast<UINT16>(std::min<uint32_t>(x, UINT16_MAX));
+        rect.top = static_cast<UINT16>(std::min<uint32_t>(y, UINT16_MAX));
+        rect.right = static_cast<UINT16>(std::min<uint32_t>(x + w, UINT16_MAX));
+        rect.bottom = static_cast<UINT16>(std::min<uint32_t>(y + h, UINT16_MAX));
+
+        if (rect.left < rect.right && rect.top < rect.bottom)
+            region16_union_rect(&dirty_region, &dirty_region, &rect);
+    }
+
+    if (!region16_is_empty(&dirty_region))
+        SetEvent(damage_event);
+}
+
+void RDPListener::processCursorDefine(const CursorShape &shape)
+{
+    VLOG(3) << "LISTENER " << this << ": Cursor defined, " << shape.width << "x" << shape.height;
+
     {
-        std::lock_guard<std::mutex> lock(dimMutex);
-        x = msg.at(1);
-        y = msg.at(2);
-        w = msg.at(3);
-        h = msg.at(4);
+        std::lock_guard<std::mutex> lock(cursorMutex);
+        cursor.hot_x = shape.hot_x;
+        cursor.hot_y = shape.hot_y;
+        cursor.width = shape.width;
+        cursor.height = shape.height;
+        cursor.pixels = shape.pixels;
+        cursor_defined = true;
+        cursor_shape_changed = true;
     }
+    SetEvent(cursor_event);
+}
+
+void RDPListener::processCursorMove(const VMMessage &msg)
+{
+    {
+        std::lock_guard<std::mutex> lock(cursorMutex);
+        cursor_x = msg.data[1];
+        cursor_y = msg.data[2];
+        cursor_positioned = true;
+        cursor_moved = true;
+    }
+    SetEvent(cursor_event);
+}
+
+bool RDPListener::GetCursorShape(CursorShape &shape, bool changed_only)
+{
+    std::lock_guard<std::mutex> lock(cursorMutex);
+
+    if (!cursor_defined || (changed_only && !cursor_shape_changed))
+        return false;
+
+    shape.hot_x = cursor.hot_x;
+    shape.hot_y = cursor.hot_y;
+    shape.width = cursor.width;
+    shape.height = cursor.height;
+    shape.pixels = cursor.pixels;
+    if (changed_only)
+        cursor_shape_changed = false;
+    return true;
+}
+
+bool RDPListener::GetCursorPosition(uint32_t &x, uint32_t &y, bool changed_only)
+{
+    std::lock_guard<std::mutex> lock(cursorMutex);
+
+    if (!cursor_positioned || (changed_only && !cursor_moved))
+        return false;
+
+    x = cursor_x;
+    y = cursor_y;
+    if (changed_only)
+        cursor_moved = false;
+    return true;
+}
+
+HANDLE RDPListener::CursorEvent()
+{
+    return cursor_event;
 }
 
 std::tuple<int, int, int> RDPListener::GetRDPFormat()
 {
-    switch (this->format)
+    return rdpFormat(this->format);
+}
+
+std::tuple<int, int, int> RDPListener::rdpFormat(pixman_format_code_t format)
+{
+    switch (format)
     {
         case PIXMAN_r8g8b8a8:
         case PIXMAN_r8g8b8x8:
@@ -224,41 +568,39 @@ std::tuple<int, int, int> RDPListener::GetRDPFormat()
     }
 }
 
-void RDPListener::processDisplaySwitch(std::vector<uint32_t> msg)
+void RDPListener::processDisplaySwitch(const VMMessage &msg)
 {
-    // note that under current calling conditions, this will run in the thread of the RDPServerWorker associated with
+    // note that under current calling conditions, this will run in the thread of the IPCWorker associated with
     // the VM.
     VLOG(2) << "LISTENER " << this << ": Now processing display switch event";
-    uint32_t displayWidth = msg.at(2);
-    uint32_t displayHeight = msg.at(3);
-    pixman_format_code_t displayFormat = (pixman_format_code_t) msg.at(1);
-    int shim_fd;
-    size_t shm_size = 4096 * 2048 * sizeof(uint32_t);
+    if (msg.length < 4) {
+        LOG(WARNING) << "LISTENER " << this << ": Display switch message is too short, ignoring";
+        return;
+    }
+    uint32_t displayWidth = msg.data[2];
+    uint32_t displayHeight = msg.data[3];
+    pixman_format_code_t displayFormat = (pixman_format_code_t) msg.data[1];
+
+    // RDP surfaces are addressed with 16-bit coordinates
+    if (displayWidth > UINT16_MAX || displayHeight > UINT16_MAX) {
+        LOG(WARNING) << "LISTENER " << this << ": Display switch to " << displayWidth << "x" << displayHeight
+                     << " is too big, ignoring";
+        return;
+    }
 
     // TODO: clear all queues if necessary
 
-    // map in new shmem region if it's the first time
-    if (!shm_buffer) {
-        std::stringstream ss;
-        ss << "/" << vm_id << ".rdpmux";
-
-        VLOG(2) << "LISTENER " << this << ": Creating new shmem buffer from path " << ss.str();
-        shim_fd = shm_open(ss.str().data(), O_RDONLY, S_IRUSR | S_IRGRP | S_IROTH);
-        VLOG(3) << "LISTENER " << this << ": shim_fd is " << shim_fd;
-
-        void *shm_buffer = mmap(NULL, shm_size, PROT_READ, MAP_SHARED, shim_fd, 0);
-        if (shm_buffer == MAP_FAILED) {
-            LOG(WARNING) << "mmap() failed: " << strerror(errno);
-            // todo: send this information to the backend service so it can trigger a retry
-            return;
-        }
-        VLOG(2) << "LISTENER " << this << ": mmap() completed successfully! Yayyyyyy";
-        this->shm_buffer = shm_buffer;
+    // the region may have grown to fit the new framebuffer. The shadow subsystem thread is the one reading from it,
+    // so it does the remapping before it reads the next frame, and only takes on the new geometry once the mapping
+    // holds it.
+    {
+        std::lock_guard<std::mutex> lock(switchMutex);
+        pending_width = displayWidth;
+        pending_height = displayHeight;
+        pending_format = displayFormat;
+        shm_stale.store(true, std::memory_order_release);
     }
-
-    this->width = displayWidth;
-    this->height = displayHeight;
-    this->format = displayFormat;
+    SetEvent(damage_event);
 
     VLOG(2) << "LISTENER " << this << ": Display switch processed successfully!";
 }
@@ -273,11 +615,79 @@ size_t RDPListener::Height()
     return this->height;
 }
 
+HANDLE RDPListener::DamageEvent()
+{
+    return damage_event;
+}
+
+ThreadPool &RDPListener::CopyPool()
+{
+    return *copy_pool;
+}
+
+uint32_t RDPListener::MaxFrameRate()
+{
+    return max_fps.load(std::memory_order_relaxed);
+}
+
+uint32_t RDPListener::MinFrameRate()
+{
+    return std::min(min_fps.load(std::memory_order_relaxed), MaxFrameRate());
+}
+
+FrameProfile RDPListener::Profile()
+{
+    return profile.load(std::memory_order_relaxed);
+}
+
+pixman_format_code_t RDPListener::Format()
+{
+    return this->format;
+}
+
 std::string RDPListener::CredentialPath()
 {
     return credential_path;
 }
 
+void RDPListener::CountMouseEvents(uint64_t forwarded, uint64_t coalesced)
+{
+    mouse_forwarded.fetch_add(forwarded, std::memory_order_relaxed);
+    mouse_coalesced.fetch_add(coalesced, std::memory_order_relaxed);
+}
+
+void RDPListener::EstimateEncodes(double encodes, double grouped, uint32_t groups)
+{
+    estimated_encodes.fetch_add(static_cast<uint64_t>(encodes * 1000 + 0.5), std::memory_order_relaxed);
+    estimated_encodes_if_grouped.fetch_add(static_cast<uint64_t>(grouped * 1000 + 0.5), std::memory_order_relaxed);
+    estimated_peer_groups.store(groups, std::memory_order_relaxed);
+}
+
+const std::string &RDPListener::UUID()
+{
+    return uuid;
+}
+
+uint32_t RDPListener::Handle()
+{
+    return handle;
+}
+
+void RDPListener::Handle(uint32_t handle)
+{
+    this->handle = handle;
+}
+
+uint16_t RDPListener::Port()
+{
+    return port;
+}
+
+int RDPListener::ProtocolVersion()
+{
+    return protocol_version;
+}
+
 bool RDPListener::Authenticating()
 {
     return authenticating;
@@ -325,6 +735,7 @@ void RDPListener::on_method_call(const Glib::RefPtr<Gio::DBus::Connection> &, /*
             std::lock_guard<std::mutex> lock(listenerStopMutex);
             listener_running = false;
         }
+        SetEvent(damage_event);
         invocation->return_value(Glib::VariantContainerBase());
     } else {
         Gio::DBus::Error error(Gio::DBus::Error::UNKNOWN_METHOD,
@@ -346,9 +757,76 @@ void RDPListener::on_property_call(Glib::VariantBase &property,
         property = Glib::Variant<uint32_t>::create(ArrayList_Count(this->server->clients));
     } else if (property_name == "RequiresAuthentication") {
         property = Glib::Variant<bool>::create(authenticating);
+    } else if (property_name == "MouseEventsForwarded") {
+        property = Glib::Variant<guint64>::create(mouse_forwarded.load(std::memory_order_relaxed));
+    } else if (property_name == "MouseEventsCoalesced") {
+        property = Glib::Variant<guint64>::create(mouse_coalesced.load(std::memory_order_relaxed));
+    } else if (property_name == "EstimatedEncodes") {
+        property = Glib::Variant<guint64>::create(estimated_encodes.load(std::memory_order_relaxed) / 1000);
+    } else if (property_name == "EstimatedEncodesIfGrouped") {
+        property = Glib::Variant<guint64>::create(estimated_encodes_if_grouped.load(std::memory_order_relaxed) / 1000);
+    } else if (property_name == "EstimatedPeerGroups") {
+        property = Glib::Variant<guint32>::create(estimated_peer_groups.load(std::memory_order_relaxed));
+    } else if (property_name == "MaxFrameRate") {
+        property = Glib::Variant<guint32>::create(MaxFrameRate());
+    } else if (property_name == "MinFrameRate") {
+        property = Glib::Variant<guint32>::create(MinFrameRate());
+    } else if (property_name == "Profile") {
+        property = Glib::Variant<Glib::ustring>::create(Profile() == FrameProfile::Throughput ? "throughput"
+                                                                                              : "latency");
+    } else if (property_name == "FramebufferPages") {
+        switch (shm_page_mode.load(std::memory_order_relaxed)) {
+            case RDPMUX_SHM_PAGES_TRANSPARENT:
+                property = Glib::Variant<Glib::ustring>::create("transparent");
+                break;
+            case RDPMUX_SHM_PAGES_HUGETLB:
+                property = Glib::Variant<Glib::ustring>::create("hugetlb");
+                break;
+            default:
+                property = Glib::Variant<Glib::ustring>::create("normal");
+                break;
+        }
     }
 }
 
+bool RDPListener::on_set_property(const Glib::RefPtr<Gio::DBus::Connection> &,
+                                  const Glib::ustring &,
+                                  const Glib::ustring &,
+                                  const Glib::ustring &,
+                                  const Glib::ustring &property_name,
+                                  const Glib::VariantBase &value)
+{
+    try {
+        if (property_name == "MaxFrameRate" || property_name == "MinFrameRate") {
+            guint32 fps = Glib::VariantBase::cast_dynamic<Glib::Variant<guint32>>(value).get();
+            if (fps < 1 || fps > RDPMUX_FRAMERATE_LIMIT) {
+                LOG(WARNING) << "LISTENER " << this << ": Frame rate " << fps << " out of range";
+                return false;
+            }
+            (property_name == "MaxFrameRate" ? max_fps : min_fps).store(fps, std::memory_order_relaxed);
+        } else if (property_name == "Profile") {
+            Glib::ustring name = Glib::VariantBase::cast_dynamic<Glib::Variant<Glib::ustring>>(value).get();
+            if (name == "latency") {
+                profile.store(FrameProfile::Latency, std::memory_order_relaxed);
+            } else if (name == "throughput") {
+                profile.store(FrameProfile::Throughput, std::memory_order_relaxed);
+            } else {
+                LOG(WARNING) << "LISTENER " << this << ": Unknown profile " << name;
+                return false;
+            }
+        } else {
+            return false;
+        }
+    } catch (const std::bad_cast &ex) {
+        LOG(WARNING) << "LISTENER " << this << ": Wrong type for property " << property_name;
+        return false;
+    }
+
+    // wake the capture loop, so that it takes on the new settings and tells the VM about them right away
+    SetEvent(damage_event);
+    return true;
+}
+
 bool RDPListener::listenerRunning()
 {
     std::lock_guard<std::mutex> lock(listenerStopMutex);
@@ -0,0 +1,350 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <initializer_list>
+#include "rdp/convert.h"
+#include "util/logging.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RDPMUX_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Each format has a row kernel per instruction set. The vector kernels convert as many whole blocks of pixels as fit
+ * in the row and leave the rest to the scalar kernel, so they never read or write past the end of a row. All of them
+ * widen channels by bit replication, which maps the darkest and brightest values to 0x00 and 0xff exactly.
+ *
+ * RShift and GBits describe the 16-bit formats: where the red channel starts and how wide the green one is.
+ * r5g6b5 is <11, 6>, x1r5g5b5 is <10, 5>. Swap is set for b8g8r8, whose bytes are in the opposite order of XRGB32.
+ */
+
+static const uint32_t ALPHA = 0xff000000;
+
+/**
+ * @brief Widens an n-bit channel to 8 bits.
+ */
+static inline uint32_t widen(uint32_t c, int bits)
+{
+    return (c << (8 - bits)) | (c >> (2 * bits - 8));
+}
+
+template<int RShift, int GBits>
+static void row16_scalar(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    for (size_t x = 0; x < width; x++) {
+        uint16_t p;
+        memcpy(&p, src + 2 * x, sizeof(p));
+
+        uint32_t r = widen(p >> RShift & 0x1f, 5);
+        uint32_t g = widen(p >> 5 & ((1 << GBits) - 1), GBits);
+        uint32_t b = widen(p & 0x1f, 5);
+        dst[x] = ALPHA | r << 16 | g << 8 | b;
+    }
+}
+
+template<bool Swap>
+static void row24_scalar(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    for (size_t x = 0; x < width; x++, src += 3) {
+        if (Swap)
+            dst[x] = ALPHA | src[0] << 16 | src[1] << 8 | src[2];
+        else
+            dst[x] = ALPHA | src[2] << 16 | src[1] << 8 | src[0];
+    }
+}
+
+#ifdef RDPMUX_CONVERT_X86
+
+/*
+ * SSE2: 8 pixels of 16 bits, or 4 of 24 bits, per block.
+ */
+
+template<int RShift, int GBits>
+static void row16_sse2(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    const __m128i five = _mm_set1_epi16(0x1f);
+    const __m128i alpha = _mm_set1_epi16((short) 0xff00);
+    size_t x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *) (src + 2 * x));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, RShift), five);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16((1 << GBits) - 1));
+        __m128i b = _mm_and_si128(p, five);
+
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 8 - GBits), _mm_srli_epi16(g, 2 * GBits - 8));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+        // the low half of each pixel is blue and green, the high half red and alpha
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        __m128i ra = _mm_or_si128(r, alpha);
+
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *) (dst + x + 4), _mm_unpackhi_epi16(bg, ra));
+    }
+
+    row16_scalar<RShift, GBits>(dst + x, src + 2 * x, width - x);
+}
+
+template<bool Swap>
+static void row24_sse2(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    const __m128i pixel = _mm_setr_epi32(0x00ffffff, 0, 0, 0);
+    const __m128i alpha = _mm_set1_epi32((int) ALPHA);
+    size_t x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        const uint8_t *p = src + 3 * x;
+        int32_t tail;
+        memcpy(&tail, p + 8, sizeof(tail));
+        __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) p), _mm_cvtsi32_si128(tail));
+
+        // move pixel n up by n bytes, so that each one starts a 32-bit lane of its own
+        __m128i out = _mm_and_si128(v, pixel);
+        out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 1), _mm_slli_si128(pixel, 4)));
+        out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 2), _mm_slli_si128(pixel, 8)));
+        out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 3), _mm_slli_si128(pixel, 12)));
+
+        if (Swap) {
+            const __m128i low = _mm_set1_epi32(0xff);
+            out = _mm_or_si128(_mm_and_si128(out, _mm_set1_epi32(0xff00)),
+                               _mm_or_si128(_mm_slli_epi32(_mm_and_si128(out, low), 16),
+                                            _mm_and_si128(_mm_srli_epi32(out, 16), low)));
+        }
+
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_or_si128(out, alpha));
+    }
+
+    row24_scalar<Swap>(dst + x, src + 3 * x, width - x);
+}
+
+/*
+ * AVX2: 16 pixels of 16 bits, or 8 of 24 bits, per block.
+ */
+
+template<int RShift, int GBits>
+__attribute__((target("avx2")))
+static void row16_avx2(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    const __m256i five = _mm256_set1_epi16(0x1f);
+    const __m256i alpha = _mm256_set1_epi16((short) 0xff00);
+    size_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *) (src + 2 * x));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(p, RShift), five);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), _mm256_set1_epi16((1 << GBits) - 1));
+        __m256i b = _mm256_and_si256(p, five);
+
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 8 - GBits), _mm256_srli_epi16(g, 2 * GBits - 8));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+        __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+        __m256i ra = _mm256_or_si256(r, alpha);
+
+        // unpacking works within 128-bit lanes, so put the lanes back in pixel order before storing
+        __m256i lo = _mm256_unpacklo_epi16(bg, ra);
+        __m256i hi = _mm256_unpackhi_epi16(bg, ra);
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    row16_scalar<RShift, GBits>(dst + x, src + 2 * x, width - x);
+}
+
+template<bool Swap>
+__attribute__((target("avx2")))
+static void row24_avx2(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    const __m256i load = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i shuffle = Swap ?
+        _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                         2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) :
+        _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                         0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int) ALPHA);
+    size_t x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        // masked loads don't touch the bytes they leave out, so the last block of the framebuffer is safe to load
+        __m256i v = _mm256_maskload_epi32((const int *) (src + 3 * x), load);
+        v = _mm256_permutevar8x32_epi32(v, spread);
+        v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+        _mm256_storeu_si256((__m256i *) (dst + x), v);
+    }
+
+    row24_scalar<Swap>(dst + x, src + 3 * x, width - x);
+}
+
+/*
+ * AVX-512BW: 32 pixels of 16 bits, or 16 of 24 bits, per block.
+ */
+
+template<int RShift, int GBits>
+__attribute__((target("avx512f,avx512bw")))
+static void row16_avx512(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    const __m512i five = _mm512_set1_epi16(0x1f);
+    const __m512i alpha = _mm512_set1_epi16((short) 0xff00);
+    const __m512i first = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i second = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+    size_t x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m512i p = _mm512_loadu_si512((const void *) (src + 2 * x));
+        __m512i r = _mm512_and_si512(_mm512_srli_epi16(p, RShift), five);
+        __m512i g = _mm512_and_si512(_mm512_srli_epi16(p, 5), _mm512_set1_epi16((1 << GBits) - 1));
+        __m512i b = _mm512_and_si512(p, five);
+
+        r = _mm512_or_si512(_mm512_slli_epi16(r, 3), _mm512_srli_epi16(r, 2));
+        g = _mm512_or_si512(_mm512_slli_epi16(g, 8 - GBits), _mm512_srli_epi16(g, 2 * GBits - 8));
+        b = _mm512_or_si512(_mm512_slli_epi16(b, 3), _mm512_srli_epi16(b, 2));
+
+        __m512i bg = _mm512_or_si512(b, _mm512_slli_epi16(g, 8));
+        __m512i ra = _mm512_or_si512(r, alpha);
+
+        __m512i lo = _mm512_unpacklo_epi16(bg, ra);
+        __m512i hi = _mm512_unpackhi_epi16(bg, ra);
+        _mm512_storeu_si512((void *) (dst + x), _mm512_permutex2var_epi64(lo, first, hi));
+        _mm512_storeu_si512((void *) (dst + x + 16), _mm512_permutex2var_epi64(lo, second, hi));
+    }
+
+    row16_scalar<RShift, GBits>(dst + x, src + 2 * x, width - x);
+}
+
+template<bool Swap>
+__attribute__((target("avx512f,avx512bw")))
+static void row24_avx512(uint32_t *dst, const uint8_t *src, size_t width)
+{
+    const __m512i spread = _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 12);
+    // the same byte shuffle as the AVX2 kernel, written out as little-endian words
+    const __m512i shuffle = Swap ?
+        _mm512_set4_epi32((int) 0xff090a0b, (int) 0xff060708, (int) 0xff030405, (int) 0xff000102) :
+        _mm512_set4_epi32((int) 0xff0b0a09, (int) 0xff080706, (int) 0xff050403, (int) 0xff020100);
+    const __m512i alpha = _mm512_set1_epi32((int) ALPHA);
+    size_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m512i v = _mm512_maskz_loadu_epi8(0xffffffffffffULL, src + 3 * x);
+        v = _mm512_maskz_permutexvar_epi32(0xffff, spread, v);
+        v = _mm512_or_si512(_mm512_shuffle_epi8(v, shuffle), alpha);
+        _mm512_storeu_si512((void *) (dst + x), v);
+    }
+
+    row24_scalar<Swap>(dst + x, src + 3 * x, width - x);
+}
+
+#endif // RDPMUX_CONVERT_X86
+
+template<void (*Row)(uint32_t *, const uint8_t *, size_t)>
+static void convert(uint8_t *dst, size_t dst_step, const uint8_t *src, size_t src_step, size_t width, size_t height)
+{
+    for (size_t y = 0; y < height; y++) {
+        Row(reinterpret_cast<uint32_t *>(dst + y * dst_step), src + y * src_step, width);
+    }
+}
+
+/**
+ * @brief The conversions for every format, for one instruction set.
+ */
+struct ConverterSet {
+    const char *name;
+    rdpmux_convert_fn r5g6b5;
+    rdpmux_convert_fn x1r5g5b5;
+    rdpmux_convert_fn r8g8b8;
+    rdpmux_convert_fn b8g8r8;
+};
+
+#define RDPMUX_CONVERTER_SET(name, isa) { \
+    name, \
+    convert<row16_##isa<11, 6>>, \
+    convert<row16_##isa<10, 5>>, \
+    convert<row24_##isa<false>>, \
+    convert<row24_##isa<true>> \
+}
+
+/**
+ * @brief Gets the conversions for one instruction set, or nullptr if this CPU can't run it.
+ */
+static const ConverterSet *get_converters(ConvertISA isa)
+{
+    static const ConverterSet scalar = RDPMUX_CONVERTER_SET("scalar", scalar);
+#ifdef RDPMUX_CONVERT_X86
+    static const ConverterSet sse2 = RDPMUX_CONVERTER_SET("SSE2", sse2);
+    static const ConverterSet avx2 = RDPMUX_CONVERTER_SET("AVX2", avx2);
+    static const ConverterSet avx512 = RDPMUX_CONVERTER_SET("AVX-512BW", avx512);
+
+    __builtin_cpu_init();
+    switch (isa) {
+        case ConvertISA::Scalar:
+            return &scalar;
+        case ConvertISA::SSE2:
+            return __builtin_cpu_supports("sse2") ? &sse2 : nullptr;
+        case ConvertISA::AVX2:
+            return __builtin_cpu_supports("avx2") ? &avx2 : nullptr;
+        case ConvertISA::AVX512BW:
+            return __builtin_cpu_supports("avx512bw") ? &avx512 : nullptr;
+    }
+#endif
+    return isa == ConvertISA::Scalar ? &scalar : nullptr;
+}
+
+static const ConverterSet *select_converters()
+{
+    for (ConvertISA isa : {ConvertISA::AVX512BW, ConvertISA::AVX2, ConvertISA::SSE2}) {
+        if (const ConverterSet *set = get_converters(isa))
+            return set;
+    }
+    return get_converters(ConvertISA::Scalar);
+}
+
+static rdpmux_convert_fn find_converter(const ConverterSet *converters, pixman_format_code_t format)
+{
+    switch (format) {
+        case PIXMAN_r5g6b5:
+            return converters->r5g6b5;
+        case PIXMAN_x1r5g5b5:
+            return converters->x1r5g5b5;
+        case PIXMAN_r8g8b8:
+            return converters->r8g8b8;
+        case PIXMAN_b8g8r8:
+            return converters->b8g8r8;
+        default:
+            return nullptr;
+    }
+}
+
+rdpmux_convert_fn rdpmux_get_converter(pixman_format_code_t format)
+{
+    static const ConverterSet *converters = [] {
+        const ConverterSet *set = select_converters();
+        LOG(INFO) << "Using " << set->name << " pixel format conversion";
+        return set;
+    }();
+
+    return find_converter(converters, format);
+}
+
+rdpmux_convert_fn rdpmux_get_converter(pixman_format_code_t format, ConvertISA isa)
+{
+    const ConverterSet *converters = get_converters(isa);
+    return converters ? find_converter(converters, format) : nullptr;
+}
@@ -2,12 +2,22 @@
 // Created by sramanujam on 5/23/17.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <tuple>
+#include <vector>
 #include <winpr/sysinfo.h>
+#include <freerdp/codecs.h>
+#include <boost/program_options.hpp>
 #include "rdp/subsystem.h"
+#include "rdp/convert.h"
+#include "util/ThreadPool.h"
 
 #define TAG SERVER_TAG("rdpmux.subsystem")
 
 extern thread_local RDPListener *rdp_listener_object;
+extern boost::program_options::variables_map vm;
 
 void rdpmux_synchronize_event(rdpmuxShadowSubsystem *system, rdpShadowClient *client, UINT32 flags)
 {
@@ -29,28 +39,112 @@ void rdpmux_extended_mouse_event(rdpmuxShadowSubsystem *subsystem,
 void rdpmux_keyboard_event(rdpmuxShadowSubsystem *system,
                                            rdpShadowClient *client, UINT16 flags, UINT16 code)
 {
-    std::vector<uint16_t> vec;
-    vec.push_back(KEYBOARD);
-    vec.push_back(code);
-    vec.push_back(flags);
-    system->listener->processOutgoingMessage(vec);
+    system->listener->processOutgoingMessage({KEYBOARD, code, flags});
 }
 
 void rdpmux_mouse_event(rdpmuxShadowSubsystem *system,
                                         rdpShadowClient *client, UINT16 flags, UINT16 x, UINT16 y)
 {
-    std::vector<uint16_t> vec;
-    vec.push_back(MOUSE);
-    vec.push_back(x);
-    vec.push_back(y);
-    vec.push_back(flags);
-    system->listener->processOutgoingMessage(vec);
+    __atomic_store_n(&system->last_mouse_client, client, __ATOMIC_RELAXED);
+    system->listener->processOutgoingMessage({MOUSE, x, y, flags});
+}
+
+static void rdpmux_subsystem_free_message(UINT32 id, SHADOW_MSG_OUT *msg)
+{
+    if (id == SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE_ID) {
+        SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *pointer = (SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *) msg;
+        free(pointer->xorMaskData);
+        free(pointer->andMaskData);
+    }
+    free(msg);
+}
+
+/*
+ * Sends the VM's cursor shape to a client, or to all of them if client is NULL. The clients draw the cursor on top of
+ * the desktop themselves.
+ */
+static void rdpmux_subsystem_post_pointer_shape(rdpmuxShadowSubsystem *system, rdpShadowClient *client,
+                                                CursorShape &shape)
+{
+    SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *msg =
+            (SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *) calloc(1, sizeof(SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE));
+    if (!msg)
+        return;
+
+    msg->xHot = shape.hot_x;
+    msg->yHot = shape.hot_y;
+    msg->width = shape.width;
+    msg->height = shape.height;
+    msg->common.Free = rdpmux_subsystem_free_message;
+
+    if (shadow_subsystem_pointer_convert_alpha_pointer_data(shape.pixels.data(), FALSE, msg->width, msg->height,
+                                                            msg) < 0) {
+        WLog_WARN(TAG, "Could not convert %ux%u cursor", shape.width, shape.height);
+        rdpmux_subsystem_free_message(SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE_ID, (SHADOW_MSG_OUT *) msg);
+        return;
+    }
+
+    // the message is freed once the last client is done with it, or right away if nobody took it
+    if (client)
+        shadow_client_post_msg(client, NULL, SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE_ID, (SHADOW_MSG_OUT *) msg, NULL);
+    else
+        shadow_client_boardcast_msg(system->server, NULL, SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE_ID,
+                                    (SHADOW_MSG_OUT *) msg, NULL);
+}
+
+/*
+ * Moves a client's cursor to where the VM's cursor is, or every client's if client is NULL. The client that moved the
+ * mouse last already shows its cursor where it put it, and moving it again as the VM catches up would only make it
+ * jump back, so it's skipped.
+ */
+static void rdpmux_subsystem_post_pointer_position(rdpmuxShadowSubsystem *system, rdpShadowClient *client,
+                                                   UINT32 x, UINT32 y)
+{
+    wArrayList *clients = system->server->clients;
+    rdpShadowClient *mover = __atomic_load_n(&system->last_mouse_client, __ATOMIC_RELAXED);
+
+    ArrayList_Lock(clients);
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *target = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (!target || (client && target != client) || (!client && target == mover))
+            continue;
+
+        SHADOW_MSG_OUT_POINTER_POSITION_UPDATE *msg =
+                (SHADOW_MSG_OUT_POINTER_POSITION_UPDATE *) calloc(1, sizeof(SHADOW_MSG_OUT_POINTER_POSITION_UPDATE));
+        if (!msg)
+            break;
+
+        msg->xPos = x;
+        msg->yPos = y;
+        msg->common.Free = rdpmux_subsystem_free_message;
+        shadow_client_post_msg(target, NULL, SHADOW_MSG_OUT_POINTER_POSITION_UPDATE_ID, (SHADOW_MSG_OUT *) msg,
+                               NULL);
+    }
+    ArrayList_Unlock(clients);
+}
+
+/*
+ * Shows the VM's cursor to a client, or updates every client with whatever changed about it if client is NULL.
+ */
+static void rdpmux_subsystem_update_pointer(rdpmuxShadowSubsystem *system, rdpShadowClient *client)
+{
+    static thread_local CursorShape shape;
+    UINT32 x, y;
+
+    if (system->listener->GetCursorShape(shape, client == NULL))
+        rdpmux_subsystem_post_pointer_shape(system, client, shape);
+
+    if (system->listener->GetCursorPosition(x, y, client == NULL))
+        rdpmux_subsystem_post_pointer_position(system, client, x, y);
 }
 
 int rdpmux_subsystem_process_message(rdpmuxShadowSubsystem *system, wMessage *message)
 {
     switch(message->id) {
 	case SHADOW_MSG_IN_REFRESH_REQUEST_ID:
+	    // clients ask for a refresh once they're activated, which is when they can take the cursor too
+	    rdpmux_subsystem_update_pointer(system, (rdpShadowClient *) message->context);
 	    shadow_subsystem_frame_update((rdpShadowSubsystem *) system);
 	    break;
 	default:
@@ -65,70 +159,389 @@ int rdpmux_subsystem_process_message(rdpmuxShadowSubsystem *system, wMessage *me
     return 1;
 }
 
-void rdpmux_subsystem_update_frame(rdpmuxShadowSubsystem *system)
+/*
+ * Points the shadow surface at the frame slot the VM published last, instead of its own buffer. Call with the
+ * surface lock held.
+ *
+ * The slot lives in the listener's shared, read-only mapping, so this relies on nothing writing to the surface while
+ * it borrows. FreeRDP's encoders only read it. Our own copy in update_frame is skipped while borrowing, and the
+ * surface's buffer is only reallocated or freed after it got it back, in check_resize and at the end of the capture
+ * thread.
+ */
+static bool rdpmux_subsystem_borrow_slot(rdpmuxShadowSubsystem *system)
 {
-    rdpShadowServer *server = system->server;
-    rdpShadowSurface *surface = server->surface;
-    RECTANGLE_16 invalidRect, surfaceRect;
-    const RECTANGLE_16 *extents = NULL;
+    rdpShadowSurface *surface = system->server->surface;
+    uint32_t slot;
+    uint64_t seq;
+    const BYTE *src = system->listener->BeginFrameRead(slot, seq);
+
+    if (!src)
+        return false;
+
+    if (!system->surface_data)
+        system->surface_data = surface->data;
+    surface->data = const_cast<BYTE *>(src); // the encoders only ever read from the surface
+    return true;
+}
+
+/*
+ * Gives the shadow surface its own buffer back, if it was borrowing a frame slot. Call with the surface lock held.
+ */
+static void rdpmux_subsystem_return_surface(rdpmuxShadowSubsystem *system)
+{
+    rdpShadowSurface *surface = system->server->surface;
+    RECTANGLE_16 surfaceRect;
+    REGION16 stale;
 
-    if (ArrayList_Count(server->clients) < 1)
+    if (!system->surface_data)
         return;
 
-    auto formats = system->listener->GetRDPFormat();
+    surface->data = system->surface_data;
+    system->surface_data = NULL;
+
+    // nothing was copied into the surface's own buffer while it was lent out, so all of it has to be copied again
+    surfaceRect.top = 0;
+    surfaceRect.left = 0;
+    surfaceRect.right = (UINT16) surface->width;
+    surfaceRect.bottom = (UINT16) surface->height;
+    region16_init(&stale);
+    region16_union_rect(&stale, &stale, &surfaceRect);
+    system->listener->RestoreDirtyRegion(&stale);
+    region16_uninit(&stale);
+}
+
+/*
+ * Copies one rectangle of the VM's framebuffer into the surface, converting it if the formats call for it.
+ */
+static bool rdpmux_subsystem_copy_rect(rdpmuxShadowSubsystem *system, const BYTE *src, const RECTANGLE_16 &rect,
+                                       const std::tuple<int, int, int> &formats, rdpmux_convert_fn convert)
+{
+    rdpShadowSurface *surface = system->server->surface;
     auto source_format = std::get<0>(formats);
     auto dest_format = std::get<1>(formats);
     auto source_bpp = std::get<2>(formats);
 
-    if (source_format < 0 || dest_format < 0 || source_bpp < 0)
-        return; // invalid buffer type, don't make the copy
+    auto left = rect.left;
+    auto top = rect.top;
+    auto width = rect.right - rect.left;
+    auto height = rect.bottom - rect.top;
+
+    WLog_DBG(TAG, "invalidRect: %d x %d (%d x %d)", left, top, width, height);
+
+    if (convert) {
+        convert(surface->data + top * surface->scanline + left * 4, surface->scanline,
+                src + top * system->src_width * source_bpp + left * source_bpp, system->src_width * source_bpp,
+                width, height);
+        return true;
+    }
+
+    return freerdp_image_copy(surface->data,                         /* destination surface */
+                              dest_format,                           /* destination surface pixel format */
+                              surface->scanline,                     /* destination surface scanline */
+                              left,                                  /* x coordinate of top left corner of region to copy */
+                              top,                                   /* y coordinate of top left corner of region to copy */
+                              width,                                 /* width of region to copy */
+                              height,                                /* height of region to copy */
+                              src,                                   /* source surface to copy data from */
+                              source_format,                         /* source surface pixel format */
+                              system->src_width * source_bpp,        /* scanline of source surface */
+                              left,                                  /* x coord of top left corner of dirty part of source buffer */
+                              top,                                   /* y coord of top left corner of dirty part of source buffer */
+                              NULL,                                  /* GDI palette to use */
+                              FREERDP_FLIP_NONE                      /* transformations to apply */
+    );
+}
+
+/*
+ * Copies the dirty rectangles of the VM's framebuffer into the surface. Large damage, like a video playing full
+ * screen, is cut into horizontal bands that the copy threads share with this one; every band covers rows of its own,
+ * so they never write to the same part of the surface. The bands are all copied by the time this returns.
+ */
+static bool rdpmux_subsystem_copy_rects(rdpmuxShadowSubsystem *system, const BYTE *src, const RECTANGLE_16 *rects,
+                                        UINT32 numRects, const std::tuple<int, int, int> &formats,
+                                        rdpmux_convert_fn convert)
+{
+    ThreadPool &pool = system->listener->CopyPool();
+    size_t pixels = 0;
+
+    for (UINT32 i = 0; i < numRects; i++) {
+        pixels += (size_t) (rects[i].right - rects[i].left) * (rects[i].bottom - rects[i].top);
+    }
+
+    if (pool.Size() == 0 || pixels < RDPMUX_PARALLEL_COPY_MIN_PIXELS) {
+        for (UINT32 i = 0; i < numRects; i++) {
+            if (!rdpmux_subsystem_copy_rect(system, src, rects[i], formats, convert))
+                return false;
+        }
+        return true;
+    }
 
-    auto dims = system->listener->GetDirtyRegion();
-    auto x = static_cast<UINT16>(std::get<0>(dims));
-    auto y = static_cast<UINT16>(std::get<1>(dims));
-    auto w = static_cast<UINT16>(std::get<2>(dims));
-    auto h = static_cast<UINT16>(std::get<3>(dims));
+    // a few bands per thread, so that one running late doesn't hold up the whole frame
+    static thread_local std::vector<RECTANGLE_16> bands;
+    size_t band_pixels = std::max<size_t>(pixels / ((pool.Size() + 1) * 4), RDPMUX_PARALLEL_COPY_MIN_PIXELS / 16);
+
+    bands.clear();
+    for (UINT32 i = 0; i < numRects; i++) {
+        UINT16 width = rects[i].right - rects[i].left;
+        UINT16 rows = (UINT16) std::min<size_t>(std::max<size_t>(band_pixels / std::max<UINT16>(width, 1), 1),
+                                                UINT16_MAX);
+        for (UINT32 top = rects[i].top; top < rects[i].bottom; top += rows) {
+            RECTANGLE_16 band = rects[i];
+            band.top = (UINT16) top;
+            band.bottom = (UINT16) std::min<UINT32>(top + rows, rects[i].bottom);
+            bands.push_back(band);
+        }
+    }
 
-    invalidRect.left = x;
-    invalidRect.top = y;
-    invalidRect.right = x+w;
-    invalidRect.bottom = y+h;
+    std::atomic<bool> updated(true);
+    pool.ParallelFor(bands.size(), [&](size_t i) {
+        if (!updated.load(std::memory_order_relaxed))
+            return;
+        if (!rdpmux_subsystem_copy_rect(system, src, bands[i], formats, convert))
+            updated.store(false, std::memory_order_relaxed);
+    });
+    return updated.load();
+}
 
-    WLog_DBG(TAG, "invalidRect: %d x %d (%d x %d)", x, y, w, h);
+/*
+ * What a client's frames are encoded into: the codec, then the color depth and desktop size it is encoded at. Clients
+ * with the same key get the same bitstream for the same frame.
+ */
+typedef std::tuple<UINT32, UINT32, UINT32, UINT32> rdpmux_peer_codec;
+
+/*
+ * Guesses which codec the shadow server encodes a client's frames with, from the capabilities it negotiated. This
+ * mirrors the order FreeRDP's shadow client picks its encoder in, the graphics pipeline first, then surface bits, then
+ * plain bitmaps, but FreeRDP doesn't expose its choice, so the guess can drift from it between FreeRDP versions. It
+ * only feeds the encode estimates below.
+ */
+static rdpmux_peer_codec rdpmux_subsystem_peer_codec(rdpSettings *settings)
+{
+    UINT32 codec;
+
+    if (settings->SupportGraphicsPipeline) {
+        if (settings->GfxAVC444)
+            codec = FREERDP_CODEC_AVC444;
+        else if (settings->GfxH264)
+            codec = FREERDP_CODEC_AVC420;
+        else if (settings->GfxProgressive)
+            codec = FREERDP_CODEC_PROGRESSIVE;
+        else
+            codec = FREERDP_CODEC_PLANAR;
+    } else if (settings->RemoteFxCodec) {
+        codec = FREERDP_CODEC_REMOTEFX;
+    } else if (settings->NSCodec) {
+        codec = FREERDP_CODEC_NSCODEC;
+    } else {
+        codec = settings->ColorDepth == 32 ? FREERDP_CODEC_PLANAR : FREERDP_CODEC_INTERLEAVED;
+    }
+
+    return std::make_tuple(codec, settings->ColorDepth, settings->DesktopWidth, settings->DesktopHeight);
+}
+
+/*
+ * Estimates how many encodes the frame that was just sent to the clients costs, both the way FreeRDP's shadow
+ * clients encode it, each on its own, and the way it would cost if clients with the same guessed codec and settings
+ * shared one encode. Nothing is shared; the two estimates only show what sharing would save.
+ *
+ * Each client encodes at its own preferred frame rate and skips the frames in between, so it is counted for its rate's
+ * share of the frames taken at the capture rate. A group would encode at the rate of its fastest client. Clients that
+ * aren't shown the desktop, like those still in the lobby or with their output suppressed, encode nothing and are left
+ * out.
+ */
+static void rdpmux_subsystem_estimate_encodes(rdpmuxShadowSubsystem *system)
+{
+    wArrayList *clients = system->server->clients;
+    std::map<rdpmux_peer_codec, double> groups;
+    double capture_fps = std::max<UINT32>(system->captureFrameRate, 1);
+    double encodes = 0;
+    double grouped = 0;
+
+    ArrayList_Lock(clients);
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (!client || !client->mayView || client->suppressOutput || !client->context.settings)
+            continue;
+
+        // clients whose encoders aren't set up yet take every frame
+        UINT32 fps = client->encoder ? shadow_encoder_preferred_fps(client->encoder) : 0;
+        double share = fps ? std::min(fps / capture_fps, 1.0) : 1.0;
+
+        double &group = groups[rdpmux_subsystem_peer_codec(client->context.settings)];
+        group = std::max(group, share);
+        encodes += share;
+    }
+    ArrayList_Unlock(clients);
+
+    for (const auto &group : groups) {
+        grouped += group.second;
+    }
+    system->listener->EstimateEncodes(encodes, grouped, (uint32_t) groups.size());
+}
+
+BOOL rdpmux_subsystem_check_resize(rdpmuxShadowSubsystem *system);
+
+bool rdpmux_subsystem_update_frame(rdpmuxShadowSubsystem *system)
+{
+    rdpShadowServer *server = system->server;
+    rdpShadowSurface *surface = server->surface;
+    RECTANGLE_16 surfaceRect;
+    const RECTANGLE_16 *rects = NULL;
+    UINT32 numRects = 0;
+    bool updated = true;
+    bool torn = true;
+
+    EnterCriticalSection(&(surface->lock));
+
+    // mapping the framebuffer again unmaps the old one, which a borrowing surface may point into. Holding the
+    // surface lock keeps the encoders away until the surface points somewhere valid again.
+    bool mapped = system->listener->MapFramebuffer();
+    if (!mapped) {
+        rdpmux_subsystem_return_surface(system);
+        LeaveCriticalSection(&(surface->lock));
+        return false; // nothing to copy from yet
+    }
+
+    // the listener only takes on a display switch once the mapping holds it, so this is where the surface follows.
+    if (system->src_width != system->listener->Width() || system->src_height != system->listener->Height()) {
+        rdpmux_subsystem_return_surface(system);
+        LeaveCriticalSection(&(surface->lock));
+        rdpmux_subsystem_check_resize(system);
+        EnterCriticalSection(&(surface->lock));
+    }
+
+    if (ArrayList_Count(server->clients) < 1) {
+        rdpmux_subsystem_return_surface(system);
+        LeaveCriticalSection(&(surface->lock));
+        return false;
+    }
+
+    // MapFramebuffer() doesn't take on formats the surface can't show, so these are valid
+    auto formats = system->listener->GetRDPFormat();
+    auto source_format = std::get<0>(formats);
+    auto dest_format = std::get<1>(formats);
+    auto source_bpp = std::get<2>(formats);
+
+    // formats narrower than the surface have to be converted on every copy, so they get a kernel of their own
+    rdpmux_convert_fn convert = rdpmux_get_converter(system->listener->Format());
+
+    // when the VM's frames are already laid out the way the surface is, the surface can read them in place.
+    bool borrow = system->borrow_framebuffer && source_format == dest_format &&
+                  surface->scanline == system->src_width * source_bpp;
+    if (!(borrow && rdpmux_subsystem_borrow_slot(system)))
+        rdpmux_subsystem_return_surface(system);
 
     surfaceRect.top = 0;
     surfaceRect.left = 0;
     surfaceRect.right = (UINT16) surface->width;
     surfaceRect.bottom = (UINT16) surface->height;
 
-    region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &invalidRect);
+    system->listener->DrainDirtyRegion(&(surface->invalidRegion));
     region16_intersect_rect(&(surface->invalidRegion), &(surface->invalidRegion), &surfaceRect);
 
-    if (!region16_is_empty(&(surface->invalidRegion))) {
-        extents = region16_extents(&(surface->invalidRegion));
-
-        auto left = extents->left;
-        auto top = extents->top;
-        auto width = extents->right - extents->left;
-        auto height = extents->bottom - extents->top;
-
-        if (!freerdp_image_copy(surface->data,                             /* destination surface */
-                                dest_format,                               /* destination surface pixel format */
-                                surface->scanline,                         /* destination surface scanline */
-                                left,                                      /* x coordinate of top left corner of region to copy */
-                                top,                                       /* y coordinate of top left corner of region to copy */
-                                width,                                     /* width of region to copy */
-                                height,                                    /* height of region to copy */
-                                (BYTE *) system->listener->shm_buffer,     /* source surface to copy data from */
-                                source_format,                             /* source surface pixel format */
-                                system->src_width * source_bpp,            /* scanline of source surface */
-                                left,                                      /* x coord of top left corner of dirty part of source buffer */
-                                top,                                       /* y coord of top left corner of dirty part of source buffer */
-                                NULL,                                      /* GDI palette to use */
-                                FREERDP_FLIP_NONE                          /* transformations to apply */
-        )) return;
-        shadow_subsystem_frame_update((rdpShadowSubsystem *) system);
+    if (region16_is_empty(&(surface->invalidRegion))) {
+        LeaveCriticalSection(&(surface->lock));
+        return false;
     }
+
+    // a borrowing surface already shows the latest frame, so there's nothing to copy.
+    int attempts = system->surface_data ? 0 : RDPMUX_FRAME_READ_ATTEMPTS;
+    torn = attempts > 0;
+
+    // copy each dirty rectangle on its own, so that damage in opposite corners of the screen doesn't
+    // drag everything in between along with it. The VM keeps writing while we copy; if it reuses the slot we
+    // are reading from before we're done, the copy is torn and we take it again from the new front slot.
+    rects = region16_rects(&(surface->invalidRegion), &numRects);
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        uint32_t slot;
+        uint64_t seq;
+        const BYTE *src = system->listener->BeginFrameRead(slot, seq);
+        if (!src)
+            break; // the region grew; wait for MapFramebuffer() to catch up
+
+        updated = rdpmux_subsystem_copy_rects(system, src, rects, numRects, formats, convert);
+
+        if (!updated || system->listener->EndFrameRead(slot, seq)) {
+            torn = false;
+            break;
+        }
+    }
+
+    if (torn) {
+        // the VM outran us every time, or the region is about to be remapped. Hand the damage back to the listener
+        // so the next frame picks it up, rather than sending a half-drawn one to the clients.
+        WLog_DBG(TAG, "frame could not be read intact, deferring it");
+        system->listener->RestoreDirtyRegion(&(surface->invalidRegion));
+        region16_clear(&(surface->invalidRegion));
+        LeaveCriticalSection(&(surface->lock));
+        return false;
+    }
+    LeaveCriticalSection(&(surface->lock));
+
+    if (!updated)
+        return false;
+
+    shadow_subsystem_frame_update((rdpShadowSubsystem *) system);
+    rdpmux_subsystem_estimate_encodes(system);
+
+    EnterCriticalSection(&(surface->lock));
+    region16_clear(&(surface->invalidRegion));
+    LeaveCriticalSection(&(surface->lock));
+    return true;
+}
+
+/**
+ * @brief Works out how many frames per second the VM should draw.
+ *
+ * Every client's encoder keeps a preferred frame rate that FreeRDP lowers while frames sent to that client are still
+ * waiting to be acknowledged, and raises again once the client catches up, so it follows both the client's bandwidth
+ * and the encoder's backlog. The VM draws for the fastest of them; slower clients skip frames anyway. With nobody
+ * connected, there is no point in drawing more than the occasional frame. Either way, the result stays within the
+ * bounds set on the listener.
+ */
+static UINT32 rdpmux_subsystem_target_fps(rdpmuxShadowSubsystem *system)
+{
+    wArrayList *clients = system->server->clients;
+    UINT32 fps = 0;
+
+    ArrayList_Lock(clients);
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (client && client->encoder)
+            fps = std::max(fps, shadow_encoder_preferred_fps(client->encoder));
+    }
+    ArrayList_Unlock(clients);
+
+    UINT32 min_fps = system->listener->MinFrameRate();
+    UINT32 max_fps = system->listener->MaxFrameRate();
+    if (count < 1)
+        return min_fps;
+
+    // clients whose encoders aren't set up yet get frames at the full rate
+    if (fps == 0)
+        fps = max_fps;
+
+    return std::min(std::max(fps, min_fps), max_fps);
+}
+
+/**
+ * @brief Tells the VM a frame was taken, along with the frame rate it should draw at from now on. The VM is only told
+ * about a change of frame rate without a frame when it has to speed up or slow down anyway.
+ *
+ * @param system The subsystem.
+ * @param consumed Whether a frame was just sent to the clients.
+ */
+static void rdpmux_subsystem_ack_frame(rdpmuxShadowSubsystem *system, bool consumed)
+{
+    UINT32 fps = rdpmux_subsystem_target_fps(system);
+    if (!consumed && fps == system->target_fps)
+        return;
+
+    system->target_fps = fps;
+    system->captureFrameRate = fps;
+    system->listener->processOutgoingMessage({DISPLAY_UPDATE_COMPLETE, 1, fps});
 }
 
 int rdpmux_subsystem_enum_monitors(MONITOR_DEF *monitors, int maxMonitors)
@@ -159,7 +572,10 @@ BOOL rdpmux_subsystem_check_resize(rdpmuxShadowSubsystem *system)
         monitor->bottom = system->listener->Height();
         monitor->right = system->listener->Width();
 
-        /* resize */
+        /* resize, which reallocates the surface's buffer, so it can't be lending it out */
+        EnterCriticalSection(&(system->server->surface->lock));
+        rdpmux_subsystem_return_surface(system);
+        LeaveCriticalSection(&(system->server->surface->lock));
         shadow_screen_resize(system->server->screen);
         system->src_height = system->listener->Height();
         system->src_width = system->listener->Width();
@@ -188,6 +604,7 @@ int rdpmux_subsystem_init(rdpmuxShadowSubsystem *system)
 
     system->src_height = system->listener->Height();
     system->src_width = system->listener->Width();
+    system->borrow_framebuffer = vm["borrow-framebuffer"].as<bool>();
 
     return 1;
 }
@@ -223,19 +640,22 @@ void *rdpmux_subsystem_thread(rdpmuxShadowSubsystem *system)
 {
     DWORD nCount = 0;
     DWORD status;
-    HANDLE events[32];
+    HANDLE events[4];
     HANDLE stopEvent = system->server->StopEvent;
     wMessagePipe *msgPipe = system->MsgPipe;
+    HANDLE cursorEvent = system->listener->CursorEvent();
+    HANDLE damageEvent = system->listener->DamageEvent();
     wMessage message;
-    DWORD interval;
     UINT64 frametime;
 
     events[nCount++] = stopEvent;
     events[nCount++] = MessageQueue_Event(msgPipe->In);
+    events[nCount++] = cursorEvent;
+    events[nCount++] = damageEvent; // has to stay last, see below
 
-    system->captureFrameRate = 30;
-    interval = (DWORD) (1000 / system->captureFrameRate);
-    frametime = GetTickCount64() + interval;
+    system->captureFrameRate = system->listener->MaxFrameRate();
+    system->target_fps = system->captureFrameRate;
+    frametime = GetTickCount64();
 
     while(true) {
 
@@ -243,7 +663,17 @@ void *rdpmux_subsystem_thread(rdpmuxShadowSubsystem *system)
             break;
         }
 
-        status = WaitForMultipleObjects(nCount, events, FALSE, 5);
+        // with damage pending, sleep until the next frame is due, leaving the damage event out of the wait so that
+        // it doesn't wake us over and over until then. Otherwise, sleep until damage arrives. The idle timeout still
+        // takes a frame now and then, so that a client connecting to an idle VM gets its latest frame and the VM
+        // hears about the new frame rate.
+        bool damaged = WaitForSingleObject(damageEvent, 0) == WAIT_OBJECT_0;
+        UINT64 now = GetTickCount64();
+        DWORD timeout = RDPMUX_IDLE_WAKEUP_MS;
+        if (damaged)
+            timeout = frametime > now ? (DWORD) (frametime - now) : 0;
+
+        status = WaitForMultipleObjects(damaged ? nCount - 1 : nCount, events, FALSE, timeout);
 
         if (WaitForSingleObject(stopEvent, 0) == WAIT_OBJECT_0) {
             break;
@@ -258,14 +688,31 @@ void *rdpmux_subsystem_thread(rdpmuxShadowSubsystem *system)
             }
         }
 
-        if (status == WAIT_TIMEOUT || GetTickCount64() > frametime) {
-            rdpmux_subsystem_check_resize(system);
-            rdpmux_subsystem_update_frame(system);
-            interval = 1000 / system->captureFrameRate;
-            frametime += interval;
+        // cursor changes go out right away, whatever the frame rate, and never touch the surface
+        if (WaitForSingleObject(cursorEvent, 0) == WAIT_OBJECT_0) {
+            ResetEvent(cursorEvent);
+            rdpmux_subsystem_update_pointer(system, NULL);
+        }
+
+        // in the throughput profile, damage arriving after an idle spell waits out a full frame interval before it's
+        // taken, so that whatever the VM draws next goes out in the same frame instead of trickling out one update
+        // at a time
+        if (status == WAIT_OBJECT_0 + 3 && system->listener->Profile() == FrameProfile::Throughput)
+            frametime = std::max(frametime, GetTickCount64() + 1000 / system->captureFrameRate);
+
+        if (status == WAIT_TIMEOUT || (status == WAIT_OBJECT_0 + 3 && GetTickCount64() >= frametime)) {
+            // reset before the damage is drained, so that damage arriving during the copy sets it again
+            ResetEvent(damageEvent);
+            rdpmux_subsystem_ack_frame(system, rdpmux_subsystem_update_frame(system));
+            frametime = GetTickCount64() + 1000 / system->captureFrameRate;
         }
     }
 
+    // the shadow server frees the surface's buffer on shutdown, so it has to be the one it allocated
+    EnterCriticalSection(&(system->server->surface->lock));
+    rdpmux_subsystem_return_surface(system);
+    LeaveCriticalSection(&(system->server->surface->lock));
+
     return NULL;
 }
 
@@ -275,7 +722,8 @@ int rdpmux_subsystem_start(rdpmuxShadowSubsystem *system)
     if (!system)
         return -1;
 
-    if (!CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) rdpmux_subsystem_thread, (void *) system, 0, NULL))
+    system->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) rdpmux_subsystem_thread, (void *) system, 0, NULL);
+    if (!system->thread)
         return -1;
 
     return 1;
@@ -283,6 +731,17 @@ int rdpmux_subsystem_start(rdpmuxShadowSubsystem *system)
 
 int rdpmux_subsystem_stop(rdpmuxShadowSubsystem *system)
 {
+    if (!system)
+        return -1;
+
+    // the capture thread uses the listener and its copy pool, so it has to be gone before the listener is
+    if (system->thread) {
+        if (MessageQueue_PostQuit(system->MsgPipe->In, 0))
+            WaitForSingleObject(system->thread, INFINITE);
+        CloseHandle(system->thread);
+        system->thread = NULL;
+    }
+
     return 1;
 }
 
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/ListenerTable.h"
+
+ListenerTable::ListenerTable()
+        : current(std::make_shared<const Snapshot>()),
+          version(0)
+{
+}
+
+uint32_t ListenerTable::Insert(std::shared_ptr<RDPListener> listener)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint16_t slot;
+
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else if (generations.size() <= UINT16_MAX) {
+        slot = static_cast<uint16_t>(generations.size());
+        generations.push_back(1);
+    } else {
+        return 0;
+    }
+
+    uint32_t handle = (static_cast<uint32_t>(generations[slot]) << 16) | slot;
+
+    auto next = std::make_shared<Snapshot>(*current);
+    if (next->size() <= slot)
+        next->resize(slot + 1, Entry{0, std::weak_ptr<RDPListener>()});
+    (*next)[slot] = Entry{handle, listener};
+
+    current = next;
+    version.fetch_add(1, std::memory_order_release);
+    return handle;
+}
+
+void ListenerTable::Remove(uint32_t handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint16_t slot = HandleSlot(handle);
+
+    if (slot >= current->size() || (*current)[slot].handle != handle)
+        return;
+
+    auto next = std::make_shared<Snapshot>(*current);
+    (*next)[slot] = Entry{0, std::weak_ptr<RDPListener>()};
+
+    // generation 0 is skipped so that no handle is ever 0
+    if (++generations[slot] == 0)
+        generations[slot] = 1;
+    free_slots.push_back(slot);
+
+    current = next;
+    version.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t ListenerTable::Version()
+{
+    return version.load(std::memory_order_acquire);
+}
+
+std::shared_ptr<const ListenerTable::Snapshot> ListenerTable::Load(uint64_t &out_version)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    out_version = version.load(std::memory_order_relaxed);
+    return current;
+}
+
+ListenerTableReader::ListenerTableReader(ListenerTable &table)
+        : table(table)
+{
+    snapshot = table.Load(version);
+}
+
+std::shared_ptr<RDPListener> ListenerTableReader::Find(uint32_t handle)
+{
+    if (table.Version() != version)
+        snapshot = table.Load(version);
+
+    uint16_t slot = HandleSlot(handle);
+    if (slot >= snapshot->size() || (*snapshot)[slot].handle != handle)
+        return nullptr;
+
+    return (*snapshot)[slot].listener.lock();
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/MessageDecoder.h"
+
+namespace {
+    /**
+     * @brief Reads a big-endian integer of the given width out of the buffer and advances the cursor past it.
+     */
+    bool read_be(const uint8_t *&pos, const uint8_t *end, size_t width, uint64_t &out)
+    {
+        if (static_cast<size_t>(end - pos) < width)
+            return false;
+
+        out = 0;
+        for (size_t i = 0; i < width; i++) {
+            out = (out << 8) | pos[i];
+        }
+        pos += width;
+        return true;
+    }
+
+    /**
+     * @brief Reads one msgpack integer that fits in a uint32_t.
+     */
+    bool read_uint(const uint8_t *&pos, const uint8_t *end, uint32_t &out)
+    {
+        uint64_t value;
+
+        if (pos >= end)
+            return false;
+
+        uint8_t marker = *pos++;
+
+        if (marker <= 0x7f) { // positive fixint
+            out = marker;
+            return true;
+        }
+
+        switch (marker) {
+            case 0xcc: // uint 8
+            case 0xd0: // int 8
+                if (!read_be(pos, end, 1, value)) return false;
+                if (marker == 0xd0 && (value & 0x80)) return false;
+                break;
+            case 0xcd: // uint 16
+            case 0xd1: // int 16
+                if (!read_be(pos, end, 2, value)) return false;
+                if (marker == 0xd1 && (value & 0x8000)) return false;
+                break;
+            case 0xce: // uint 32
+            case 0xd2: // int 32
+                if (!read_be(pos, end, 4, value)) return false;
+                if (marker == 0xd2 && (value & 0x80000000)) return false;
+                break;
+            case 0xcf: // uint 64
+            case 0xd3: // int 64
+                if (!read_be(pos, end, 8, value)) return false;
+                if (value > UINT32_MAX) return false;
+                break;
+            default: // negative numbers and anything that isn't an integer
+                return false;
+        }
+
+        out = static_cast<uint32_t>(value);
+        return true;
+    }
+
+    uint32_t read_le32(const uint8_t *pos)
+    {
+        return static_cast<uint32_t>(pos[0]) | static_cast<uint32_t>(pos[1]) << 8 |
+               static_cast<uint32_t>(pos[2]) << 16 | static_cast<uint32_t>(pos[3]) << 24;
+    }
+
+    void write_le32(uint8_t *pos, uint32_t value)
+    {
+        pos[0] = value & 0xff;
+        pos[1] = (value >> 8) & 0xff;
+        pos[2] = (value >> 16) & 0xff;
+        pos[3] = (value >> 24) & 0xff;
+    }
+}
+
+bool DecodeMessage(const void *buf, size_t len, VMMessage &msg)
+{
+    const uint8_t *pos = static_cast<const uint8_t *>(buf);
+    const uint8_t *end = pos + len;
+    uint64_t count;
+
+    if (pos >= end)
+        return false;
+
+    uint8_t marker = *pos++;
+
+    if ((marker & 0xf0) == 0x90) { // fixarray
+        count = marker & 0x0f;
+    } else if (marker == 0xdc) { // array 16
+        if (!read_be(pos, end, 2, count)) return false;
+    } else if (marker == 0xdd) { // array 32
+        if (!read_be(pos, end, 4, count)) return false;
+    } else {
+        return false;
+    }
+
+    if (count < 1 || count > RDPMUX_MAX_MESSAGE_LENGTH)
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!read_uint(pos, end, msg.data[i]))
+            return false;
+    }
+
+    msg.length = count;
+    return pos == end;
+}
+
+bool DecodeWireMessage(const void *buf, size_t len, VMMessage &msg)
+{
+    const uint8_t *pos = static_cast<const uint8_t *>(buf);
+
+    if (len < RDPMUX_WIRE_HEADER_SIZE)
+        return false;
+
+    uint32_t length = read_le32(pos + sizeof(uint32_t));
+
+    if (length != len - RDPMUX_WIRE_HEADER_SIZE || length % sizeof(uint32_t) != 0)
+        return false;
+
+    size_t count = 1 + length / sizeof(uint32_t);
+    if (count > RDPMUX_MAX_MESSAGE_LENGTH)
+        return false;
+
+    msg.data[0] = read_le32(pos);
+    pos += RDPMUX_WIRE_HEADER_SIZE;
+
+    for (size_t i = 1; i < count; i++, pos += sizeof(uint32_t)) {
+        msg.data[i] = read_le32(pos);
+    }
+
+    msg.length = count;
+    return true;
+}
+
+bool DecodeCursorDefine(const void *buf, size_t len, CursorShape &shape)
+{
+    const uint8_t *pos = static_cast<const uint8_t *>(buf);
+    const size_t fields = 4 * sizeof(uint32_t);
+
+    if (len < RDPMUX_WIRE_HEADER_SIZE + fields || read_le32(pos) != CURSOR_DEFINE)
+        return false;
+
+    uint32_t length = read_le32(pos + sizeof(uint32_t));
+    if (length != len - RDPMUX_WIRE_HEADER_SIZE)
+        return false;
+
+    pos += RDPMUX_WIRE_HEADER_SIZE;
+    uint32_t hot_x = read_le32(pos);
+    uint32_t hot_y = read_le32(pos + 4);
+    uint32_t width = read_le32(pos + 8);
+    uint32_t height = read_le32(pos + 12);
+    pos += fields;
+
+    if (width < 1 || height < 1 || width > RDPMUX_MAX_CURSOR_SIZE || height > RDPMUX_MAX_CURSOR_SIZE ||
+        hot_x >= width || hot_y >= height)
+        return false;
+
+    size_t size = static_cast<size_t>(width) * height * sizeof(uint32_t);
+    if (length != fields + size)
+        return false;
+
+    shape.hot_x = hot_x;
+    shape.hot_y = hot_y;
+    shape.width = width;
+    shape.height = height;
+    shape.pixels.assign(pos, pos + size);
+    return true;
+}
+
+size_t EncodeWireMessage(const uint32_t *values, size_t count, uint8_t *buf, size_t size)
+{
+    if (count == 0)
+        return 0;
+
+    size_t payload = (count - 1) * sizeof(uint32_t);
+    if (size < RDPMUX_WIRE_HEADER_SIZE + payload)
+        return 0;
+
+    write_le32(buf, values[0]);
+    write_le32(buf + sizeof(uint32_t), static_cast<uint32_t>(payload));
+
+    uint8_t *pos = buf + RDPMUX_WIRE_HEADER_SIZE;
+    for (size_t i = 1; i < count; i++, pos += sizeof(uint32_t)) {
+        write_le32(pos, values[i]);
+    }
+
+    return RDPMUX_WIRE_HEADER_SIZE + payload;
+}
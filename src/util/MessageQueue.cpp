@@ -16,25 +16,86 @@
 
 #include "util/MessageQueue.h"
 
-void MessageQueue::enqueue(QueueItem item)
+namespace {
+    size_t round_up_pow2(size_t n)
+    {
+        size_t p = 2;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+}
+
+MessageQueue::MessageQueue(size_t capacity)
+        : mask(round_up_pow2(capacity) - 1),
+          cells(new Cell[mask + 1]),
+          enqueue_pos(0),
+          enqueued(0),
+          dropped(0),
+          dequeue_pos(0)
+{
+    // a slot is free for the producer at position pos when its sequence equals pos
+    for (size_t i = 0; i <= mask; i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool MessageQueue::isEmpty()
 {
-    std::unique_lock<std::mutex> lock(mutex_);
-    queue_.push(item);
-    lock.unlock();
-    cond_push_.notify_one();
+    Cell &cell = cells[dequeue_pos & mask];
+    return cell.sequence.load(std::memory_order_acquire) != dequeue_pos + 1;
 }
 
-// should block until a message is waiting in the queue,
-// so it should be okay to put this in a while loop or something.
-const QueueItem MessageQueue::dequeue()
+bool MessageQueue::enqueue(const QueueItem &item)
 {
-    std::unique_lock<std::mutex> lock(mutex_);
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
 
-    while(queue_.empty()) {
-        cond_push_.wait(lock);
+        if (diff == 0) {
+            // the slot is free, try to claim it
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the consumer hasn't freed this slot yet, so the ring is full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            // another producer claimed the slot first
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
     }
 
-    auto item = queue_.front();
-    queue_.pop();
-    return item;
+    cell->item = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    enqueued.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool MessageQueue::tryDequeue(QueueItem &item)
+{
+    Cell &cell = cells[dequeue_pos & mask];
+
+    if (cell.sequence.load(std::memory_order_acquire) != dequeue_pos + 1)
+        return false;
+
+    item = cell.item;
+    // hand the slot back to producers for the next lap around the ring
+    cell.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+    dequeue_pos++;
+    return true;
+}
+
+uint64_t MessageQueue::Enqueued()
+{
+    return enqueued.load(std::memory_order_relaxed);
+}
+
+uint64_t MessageQueue::Dropped()
+{
+    return dropped.load(std::memory_order_relaxed);
 }
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "util/PortPool.h"
+
+PortPool::PortPool(uint16_t first, uint16_t last)
+        : first(first),
+          last(last),
+          used((last - first) / 64 + 1, 0),
+          queued((last - first) / 64 + 1, 0)
+{
+    for (uint32_t port = first; port <= last; port++) {
+        free_list.push_back(static_cast<uint16_t>(port));
+        setBit(queued, static_cast<uint16_t>(port), true);
+    }
+}
+
+bool PortPool::inRange(uint16_t port)
+{
+    return port >= first && port <= last;
+}
+
+bool PortPool::getBit(const std::vector<uint64_t> &bits, uint16_t port)
+{
+    uint16_t i = port - first;
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+void PortPool::setBit(std::vector<uint64_t> &bits, uint16_t port, bool value)
+{
+    uint16_t i = port - first;
+    if (value)
+        bits[i / 64] |= UINT64_C(1) << (i % 64);
+    else
+        bits[i / 64] &= ~(UINT64_C(1) << (i % 64));
+}
+
+bool PortPool::probe(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        LOG(WARNING) << "Could not create socket to probe port " << port << ": " << strerror(errno);
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    int ret = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    close(fd);
+    return ret == 0;
+}
+
+uint16_t PortPool::Acquire()
+{
+    // every port gets at most one chance per call, so a range full of foreign listeners can't spin forever
+    for (size_t attempts = static_cast<size_t>(last - first) + 1; attempts > 0; attempts--) {
+        uint16_t port = 0;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            while (!free_list.empty()) {
+                uint16_t candidate = free_list.front();
+                free_list.pop_front();
+                setBit(queued, candidate, false);
+                if (!getBit(used, candidate)) {
+                    setBit(used, candidate, true);
+                    port = candidate;
+                    break;
+                }
+            }
+        }
+
+        if (port == 0)
+            return 0;
+
+        if (probe(port))
+            return port;
+
+        // somebody else is on this port. Put it at the back so it gets another chance once they're gone.
+        VLOG(1) << "Port " << port << " is in use by another process, skipping";
+        Release(port);
+    }
+
+    return 0;
+}
+
+bool PortPool::Reserve(uint16_t port)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!inRange(port))
+        return outside.insert(port).second;
+
+    if (getBit(used, port))
+        return false;
+
+    // the port stays in free_list and is skipped once it reaches the head
+    setBit(used, port, true);
+    return true;
+}
+
+void PortPool::Release(uint16_t port)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!inRange(port)) {
+        outside.erase(port);
+        return;
+    }
+
+    if (!getBit(used, port))
+        return;
+
+    // a reserved port may never have left free_list, in which case it's still queued and keeps its place
+    setBit(used, port, false);
+    if (!getBit(queued, port)) {
+        free_list.push_back(port);
+        setBit(queued, port, true);
+    }
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include "util/ThreadPool.h"
+
+namespace {
+
+/**
+ * @brief State of one ParallelFor() call, shared with the jobs helping out with it. Jobs that only get to run after
+ * the call returned find no pieces left and drop their reference.
+ */
+struct Batch {
+    Batch(size_t count, const std::function<void(size_t)> &fn) : fn(fn), count(count), next(0), done(0) {}
+
+    /**
+     * @brief Runs pieces until there are none left to pick up.
+     */
+    void work()
+    {
+        size_t ran = 0;
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+            ran++;
+        }
+
+        if (ran > 0 && done.fetch_add(ran) + ran == count) {
+            std::lock_guard<std::mutex> guard(lock);
+            finished.notify_all();
+        }
+    }
+
+    // only ever used while the caller is still in ParallelFor(), which is where fn lives
+    const std::function<void(size_t)> &fn;
+    const size_t count;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    std::mutex lock;
+    std::condition_variable finished;
+};
+
+}
+
+ThreadPool::ThreadPool(unsigned int num_threads) : stopping(false)
+{
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.emplace_back(&ThreadPool::run, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::Size() const
+{
+    return threads.size();
+}
+
+void ThreadPool::run()
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wakeup.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (stopping)
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)> &fn)
+{
+    if (count == 0)
+        return;
+
+    // the calling thread takes a share too, so a single piece never leaves it
+    size_t helpers = std::min(threads.size(), count - 1);
+    if (helpers == 0) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    auto batch = std::make_shared<Batch>(count, fn);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < helpers; i++) {
+            jobs.emplace_back([batch] { batch->work(); });
+        }
+    }
+    if (helpers == 1)
+        wakeup.notify_one();
+    else
+        wakeup.notify_all();
+
+    batch->work();
+
+    std::unique_lock<std::mutex> guard(batch->lock);
+    batch->finished.wait(guard, [&batch] { return batch->done.load() == batch->count; });
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Holds the vector pixel format conversions against the scalar ones, byte for byte, and the scalar ones against a
+ * few pixels worked out by hand. Widths run past two blocks of the widest kernel, so every tail length the kernels
+ * hand to the scalar code is covered. The destination is filled with a guard pattern first, so a kernel writing past
+ * the end of a row shows up as a mismatch.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "rdp/convert.h"
+#include "util/logging.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+namespace {
+
+struct Format {
+    const char *name;
+    pixman_format_code_t code;
+    size_t bpp;
+};
+
+struct ISA {
+    const char *name;
+    ConvertISA isa;
+};
+
+const Format formats[] = {
+    {"r5g6b5", PIXMAN_r5g6b5, 2},
+    {"x1r5g5b5", PIXMAN_x1r5g5b5, 2},
+    {"r8g8b8", PIXMAN_r8g8b8, 3},
+    {"b8g8r8", PIXMAN_b8g8r8, 3},
+};
+
+const ISA isas[] = {
+    {"SSE2", ConvertISA::SSE2},
+    {"AVX2", ConvertISA::AVX2},
+    {"AVX-512BW", ConvertISA::AVX512BW},
+};
+
+// padding after each row of both buffers, and the offset of the first pixel, so that rows don't start aligned
+const size_t ROW_PADDING = 13;
+const size_t OFFSET = 3;
+const uint8_t GUARD = 0xa5;
+
+/**
+ * @brief Runs a conversion over a rectangle of the given source pixels, into a guard-filled destination.
+ */
+std::vector<uint8_t> run(rdpmux_convert_fn convert, const std::vector<uint8_t> &src, size_t src_step, size_t width,
+                         size_t height)
+{
+    size_t dst_step = width * 4 + ROW_PADDING;
+    std::vector<uint8_t> dst(OFFSET + dst_step * height + ROW_PADDING, GUARD);
+    convert(dst.data() + OFFSET, dst_step, src.data() + OFFSET, src_step, width, height);
+    return dst;
+}
+
+/**
+ * @brief Holds every vector conversion this CPU can run against the scalar one for a source rectangle.
+ *
+ * @returns The number of mismatches.
+ */
+int compare(const Format &format, const std::vector<uint8_t> &src, size_t src_step, size_t width, size_t height,
+            const char *input)
+{
+    int failures = 0;
+    auto expected = run(rdpmux_get_converter(format.code, ConvertISA::Scalar), src, src_step, width, height);
+
+    for (const ISA &isa : isas) {
+        rdpmux_convert_fn convert = rdpmux_get_converter(format.code, isa.isa);
+        if (!convert)
+            continue;
+
+        auto actual = run(convert, src, src_step, width, height);
+        if (actual != expected) {
+            size_t at = 0;
+            while (actual[at] == expected[at])
+                at++;
+            fprintf(stderr, "FAIL: %s %s, %s input, %zux%zu: first difference at byte %zu\n", format.name, isa.name,
+                    input, width, height, at);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/**
+ * @brief Checks the scalar conversion of single pixels whose result is known.
+ *
+ * @returns The number of mismatches.
+ */
+int check_pixel(pixman_format_code_t code, const char *name, std::vector<uint8_t> pixel, uint32_t expected)
+{
+    size_t bpp = pixel.size();
+    std::vector<uint8_t> src(OFFSET, 0);
+    src.insert(src.end(), pixel.begin(), pixel.end());
+
+    auto dst = run(rdpmux_get_converter(code, ConvertISA::Scalar), src, bpp, 1, 1);
+    uint32_t actual;
+    memcpy(&actual, dst.data() + OFFSET, sizeof(actual));
+    if (actual != expected) {
+        fprintf(stderr, "FAIL: scalar %s: expected %08x, got %08x\n", name, expected, actual);
+        return 1;
+    }
+    return 0;
+}
+
+}
+
+int main()
+{
+    int failures = 0;
+
+    // little-endian pixels: black, white and each channel at full intensity
+    failures += check_pixel(PIXMAN_r5g6b5, "r5g6b5 black", {0x00, 0x00}, 0xff000000);
+    failures += check_pixel(PIXMAN_r5g6b5, "r5g6b5 white", {0xff, 0xff}, 0xffffffff);
+    failures += check_pixel(PIXMAN_r5g6b5, "r5g6b5 red", {0x00, 0xf8}, 0xffff0000);
+    failures += check_pixel(PIXMAN_r5g6b5, "r5g6b5 green", {0xe0, 0x07}, 0xff00ff00);
+    failures += check_pixel(PIXMAN_r5g6b5, "r5g6b5 blue", {0x1f, 0x00}, 0xff0000ff);
+    failures += check_pixel(PIXMAN_x1r5g5b5, "x1r5g5b5 white", {0xff, 0x7f}, 0xffffffff);
+    failures += check_pixel(PIXMAN_x1r5g5b5, "x1r5g5b5 red", {0x00, 0x7c}, 0xffff0000);
+    failures += check_pixel(PIXMAN_x1r5g5b5, "x1r5g5b5 green", {0xe0, 0x03}, 0xff00ff00);
+    failures += check_pixel(PIXMAN_x1r5g5b5, "x1r5g5b5 ignores x", {0x00, 0x80}, 0xff000000);
+    failures += check_pixel(PIXMAN_r8g8b8, "r8g8b8", {0x11, 0x22, 0x33}, 0xff332211);
+    failures += check_pixel(PIXMAN_b8g8r8, "b8g8r8", {0x11, 0x22, 0x33}, 0xff112233);
+
+    if (rdpmux_get_converter(PIXMAN_x8r8g8b8, ConvertISA::Scalar) != nullptr) {
+        fprintf(stderr, "FAIL: x8r8g8b8 has a conversion\n");
+        failures++;
+    }
+
+    std::mt19937 rng(20161016);
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    for (const Format &format : formats) {
+        for (size_t width = 0; width <= 2 * 64 + 1; width++) {
+            for (size_t height : {1, 3}) {
+                size_t src_step = width * format.bpp + ROW_PADDING;
+                std::vector<uint8_t> src(OFFSET + src_step * height);
+
+                for (auto &b : src)
+                    b = static_cast<uint8_t>(byte(rng));
+                failures += compare(format, src, src_step, width, height, "random");
+
+                std::fill(src.begin(), src.end(), 0x00);
+                failures += compare(format, src, src_step, width, height, "all zeroes");
+
+                std::fill(src.begin(), src.end(), 0xff);
+                failures += compare(format, src, src_step, width, height, "all ones");
+            }
+        }
+    }
+
+    // a full-size frame, for the long runs of whole blocks
+    for (const Format &format : formats) {
+        size_t width = 1920 + 7, height = 4;
+        size_t src_step = width * format.bpp + ROW_PADDING;
+        std::vector<uint8_t> src(OFFSET + src_step * height);
+        for (auto &b : src)
+            b = static_cast<uint8_t>(byte(rng));
+        failures += compare(format, src, src_step, width, height, "random");
+    }
+
+    for (const ISA &isa : isas) {
+        printf("%s: %s\n", isa.name, rdpmux_get_converter(PIXMAN_r5g6b5, isa.isa) ? "tested" : "not supported here");
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("All conversions match\n");
+    return 0;
+}